@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Local file and split archive backends for archive_io_t, and selection
+// between backends
+#include "archive_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HTTP_PREFIX "http://"
+
+typedef struct {
+    archive_io_t ops;
+    int fd;
+} local_io_t;
+
+static ssize_t local_read_at(archive_io_t *io, void *buf, size_t len, off_t offset) {
+    local_io_t *local = (local_io_t *) io;
+    ssize_t ret;
+    do {
+        ret = pread(local->fd, buf, len, offset);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static int local_fd(archive_io_t *io) {
+    return ((local_io_t *) io)->fd;
+}
+
+static int local_close(archive_io_t *io) {
+    local_io_t *local = (local_io_t *) io;
+    int ret = close(local->fd);
+    free(local);
+    return ret;
+}
+
+archive_io_t *archive_io_open_local(const char *path) {
+    local_io_t *local = malloc(sizeof(local_io_t));
+    if (!local) {
+        return NULL;
+    }
+    local->fd = open(path, O_RDONLY);
+    if (local->fd < 0) {
+        free(local);
+        return NULL;
+    }
+    local->ops.read_at = local_read_at;
+    local->ops.fd = local_fd;
+    local->ops.close = local_close;
+    return &local->ops;
+}
+
+// Parts of a split archive, read as if they were concatenated
+typedef struct {
+    archive_io_t ops;
+    int num_parts;
+    int *fds;
+    // Offset of each part within the whole archive, plus the total size at the end
+    off_t *starts;
+} split_io_t;
+
+static ssize_t split_read_at(archive_io_t *io, void *buf, size_t len, off_t offset) {
+    split_io_t *split = (split_io_t *) io;
+    if (offset >= split->starts[split->num_parts]) {
+        return 0;
+    }
+    // Find the last part starting at or before 'offset'
+    int low = 0;
+    int high = split->num_parts - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (split->starts[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    // Reads stop at the end of the part, callers retry for the rest
+    off_t left_in_part = split->starts[low + 1] - offset;
+    if (len > left_in_part) {
+        len = left_in_part;
+    }
+    ssize_t ret;
+    do {
+        ret = pread(split->fds[low], buf, len, offset - split->starts[low]);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static int split_fd(archive_io_t *io) {
+    return -1;
+}
+
+static int split_close(archive_io_t *io) {
+    split_io_t *split = (split_io_t *) io;
+    int ret = 0;
+    for (int i = 0; i < split->num_parts; i++) {
+        if (close(split->fds[i]) != 0) {
+            ret = -1;
+        }
+    }
+    free(split->fds);
+    free(split->starts);
+    free(split);
+    return ret;
+}
+
+/*
+ * Opens part 'index' of the split archive 'name' and checks it has 'size' bytes
+ * Returns its file descriptor, or -1 if an error occurs
+ */
+static int open_part(const char *name, int index, long long size) {
+    char part_name[PATH_MAX];
+    if (snprintf(part_name, sizeof(part_name), ARCHIVE_PART_NAME_FORMAT, name, index) >=
+        sizeof(part_name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = open(part_name, O_RDONLY);
+    if (fd < 0) {
+        // A part missing from a complete list is damage, not a missing archive
+        if (errno == ENOENT) {
+            printf("Archive part %s is missing\n", part_name);
+            errno = EIO;
+        }
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (stat_buf.st_size != size) {
+        printf("Archive part %s does not have the size in its part list\n", part_name);
+        close(fd);
+        errno = EIO;
+        return -1;
+    }
+    return fd;
+}
+
+archive_io_t *archive_io_open_split(const char *name) {
+    char list_name[PATH_MAX];
+    if (snprintf(list_name, sizeof(list_name), ARCHIVE_PART_LIST_FORMAT, name) >=
+        sizeof(list_name)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    FILE *list = fopen(list_name, "r");
+    if (!list) {
+        // Parts without a list are what an interrupted create leaves behind
+        char part_name[PATH_MAX];
+        snprintf(part_name, sizeof(part_name), ARCHIVE_PART_NAME_FORMAT, name, 0);
+        if (errno == ENOENT && access(part_name, F_OK) == 0) {
+            printf("Split archive %s has no part list, it was not completely written\n", name);
+            errno = EIO;
+        }
+        return NULL;
+    }
+    int num_parts;
+    if (fscanf(list, "%d", &num_parts) != 1 || num_parts < 1) {
+        printf("Damaged archive part list %s\n", list_name);
+        fclose(list);
+        errno = EIO;
+        return NULL;
+    }
+
+    split_io_t *split = calloc(1, sizeof(split_io_t));
+    if (!split) {
+        fclose(list);
+        return NULL;
+    }
+    split->ops.read_at = split_read_at;
+    split->ops.fd = split_fd;
+    split->ops.close = split_close;
+    split->fds = malloc(num_parts * sizeof(int));
+    split->starts = malloc((num_parts + 1) * sizeof(off_t));
+    if (!split->fds || !split->starts) {
+        fclose(list);
+        split_close(&split->ops);
+        errno = ENOMEM;
+        return NULL;
+    }
+    split->starts[0] = 0;
+
+    // Only the parts in the list belong to the archive, later ones are ignored
+    while (split->num_parts < num_parts) {
+        long long size;
+        if (fscanf(list, "%lld", &size) != 1 || size < 0) {
+            printf("Damaged archive part list %s\n", list_name);
+            errno = EIO;
+            break;
+        }
+        int fd = open_part(name, split->num_parts, size);
+        if (fd < 0) {
+            break;
+        }
+        split->fds[split->num_parts] = fd;
+        split->starts[split->num_parts + 1] = split->starts[split->num_parts] + size;
+        split->num_parts++;
+    }
+    int saved_errno = errno;
+    fclose(list);
+    if (split->num_parts == num_parts) {
+        return &split->ops;
+    }
+    split_close(&split->ops);
+    errno = saved_errno;
+    return NULL;
+}
+
+int archive_io_is_remote(const char *name) {
+    return strncmp(name, HTTP_PREFIX, strlen(HTTP_PREFIX)) == 0;
+}
+
+archive_io_t *archive_io_open(const char *name) {
+    if (archive_io_is_remote(name)) {
+        return archive_io_open_http(name);
+    }
+    archive_io_t *io = archive_io_open_local(name);
+    if (!io && errno == ENOENT) {
+        io = archive_io_open_split(name);
+    }
+    return io;
+}
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _ARCHIVE_IO_H
+#define _ARCHIVE_IO_H
+
+#include <sys/types.h>
+
+// Byte-addressed read access to an archive, independent of where it is stored.
+// Each backend fills in the operations below; callers only use these.
+// Archives are written through stdio on local files instead.
+typedef struct archive_io archive_io_t;
+struct archive_io {
+    // Read up to 'len' bytes at 'offset' into 'buf'
+    // Returns the number of bytes read (0 at the end of the archive), or -1 on error
+    ssize_t (*read_at)(archive_io_t *io, void *buf, size_t len, off_t offset);
+    // Returns a file descriptor for the archive if it is a local file, or -1
+    int (*fd)(archive_io_t *io);
+    // Release everything held by 'io', including 'io' itself
+    // Returns 0 on success or -1 on error
+    int (*close)(archive_io_t *io);
+};
+
+// Open the local file 'path' for reading
+// Returns NULL if an error occurs
+archive_io_t *archive_io_open_local(const char *path);
+
+// Open the archive at 'url' (http://host[:port]/path) read-only through HTTP
+// range requests, with adaptive read-ahead. Returns NULL if an error occurs
+archive_io_t *archive_io_open_http(const char *url);
+
+// Name of part 'index' of the split archive 'name', e.g. "foo.tar.000"
+#define ARCHIVE_PART_NAME_FORMAT "%s.%03d"
+// Name of the list of the parts of the split archive 'name' and their sizes,
+// e.g. "foo.tar.parts". It is written after all the parts, so an archive
+// whose creation was interrupted has none.
+#define ARCHIVE_PART_LIST_FORMAT "%s.parts"
+
+// Open the parts of the split archive 'name' read-only as one archive, after
+// checking them against its part list
+// Returns NULL if an error occurs, with errno ENOENT if there are no parts
+archive_io_t *archive_io_open_split(const char *name);
+
+// Returns 1 if 'name' refers to a remote archive rather than a local file
+int archive_io_is_remote(const char *name);
+
+// Open 'name' read-only with whichever backend it refers to. A local name
+// that does not exist is opened as a split archive if its parts exist.
+// Returns NULL if an error occurs
+archive_io_t *archive_io_open(const char *name);
+
+#endif    // _ARCHIVE_IO_H
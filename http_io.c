@@ -0,0 +1,417 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Read-only archive_io_t backend that fetches byte ranges over HTTP/1.1
+//
+// Reads are served from a cached window of the archive. On a miss, the window
+// is refilled with a single range request whose size adapts to the access
+// pattern: it doubles while reads keep landing at or just past the end of the
+// previous window, so sequential data reads turn into few large requests and
+// closely spaced headers are coalesced into one, and it drops back to a small
+// size after a long jump, so listing an archive of huge members only fetches
+// a little around each header.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "archive_io.h"
+
+#define HTTP_PREFIX "http://"
+#define MIN_READ_AHEAD (4 * 1024)
+#define INITIAL_READ_AHEAD (64 * 1024)
+#define MAX_READ_AHEAD (8 * 1024 * 1024)
+#define MAX_HOST_LEN 256
+#define MAX_PORT_LEN 8
+#define MAX_PATH_LEN 1024
+#define MAX_REQUEST_LEN (MAX_PATH_LEN + MAX_HOST_LEN + 256)
+// Response headers must fit in this many bytes
+#define RECV_BUF_SIZE 8192
+
+typedef struct {
+    archive_io_t ops;
+    char host[MAX_HOST_LEN];
+    char port[MAX_PORT_LEN];
+    char path[MAX_PATH_LEN];
+    // Connection kept alive between requests, -1 when not connected
+    int sock;
+    // Total archive size from the Content-Range header, -1 until known
+    off_t size;
+    // Window of the archive currently cached, at most MAX_READ_AHEAD bytes
+    char *cache;
+    off_t cache_off;
+    size_t cache_len;
+    // Size of the next window to fetch, and where the last fetched one ended
+    size_t read_ahead;
+    off_t last_end;
+    // Bytes received from the socket but not consumed yet
+    char recv_buf[RECV_BUF_SIZE];
+    size_t recv_len;
+} http_io_t;
+
+/*
+ * Splits 'url' into the host, port and path fields of 'http'
+ * Returns 0 on success or -1 if 'url' is not a supported URL
+ */
+static int parse_url(http_io_t *http, const char *url) {
+    if (strncmp(url, HTTP_PREFIX, strlen(HTTP_PREFIX)) != 0) {
+        return -1;
+    }
+    const char *host = url + strlen(HTTP_PREFIX);
+    const char *path = strchr(host, '/');
+    if (!path) {
+        path = host + strlen(host);
+    }
+    const char *colon = memchr(host, ':', path - host);
+    const char *host_end = colon ? colon : path;
+    if (host_end == host || host_end - host >= MAX_HOST_LEN) {
+        return -1;
+    }
+    memcpy(http->host, host, host_end - host);
+    http->host[host_end - host] = '\0';
+
+    if (colon) {
+        if (path - colon - 1 <= 0 || path - colon - 1 >= MAX_PORT_LEN) {
+            return -1;
+        }
+        memcpy(http->port, colon + 1, path - colon - 1);
+        http->port[path - colon - 1] = '\0';
+    } else {
+        strcpy(http->port, "80");
+    }
+
+    if (strlen(path) >= MAX_PATH_LEN) {
+        return -1;
+    }
+    strcpy(http->path, *path ? path : "/");
+    return 0;
+}
+
+static void http_disconnect(http_io_t *http) {
+    if (http->sock >= 0) {
+        close(http->sock);
+        http->sock = -1;
+    }
+    http->recv_len = 0;
+}
+
+/*
+ * Opens a new connection to the server
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int http_connect(http_io_t *http) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs;
+    int ret = getaddrinfo(http->host, http->port, &hints, &addrs);
+    if (ret != 0) {
+        printf("Failed to resolve %s: %s\n", http->host, gai_strerror(ret));
+        return -1;
+    }
+    for (struct addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+        http->sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (http->sock < 0) {
+            continue;
+        }
+        if (connect(http->sock, addr->ai_addr, addr->ai_addrlen) == 0) {
+            // Requests are small and each waits for its reply, so never delay them
+            int one = 1;
+            setsockopt(http->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(http->sock);
+        http->sock = -1;
+    }
+    freeaddrinfo(addrs);
+    if (http->sock < 0) {
+        perror("Failed to connect to archive server");
+        return -1;
+    }
+    http->recv_len = 0;
+    return 0;
+}
+
+static int send_all(int sock, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t ret = send(sock, buf, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/*
+ * Receives response headers into 'headers' (RECV_BUF_SIZE bytes), keeping any
+ * body bytes that arrived with them in the receive buffer
+ * Returns 0 on success, or -1 if the connection failed or closed first
+ */
+static int recv_headers(http_io_t *http, char *headers) {
+    char *end;
+    while ((end = memmem(http->recv_buf, http->recv_len, "\r\n\r\n", 4)) == NULL) {
+        if (http->recv_len == RECV_BUF_SIZE) {
+            printf("HTTP response headers too long\n");
+            return -1;
+        }
+        ssize_t ret = recv(http->sock, http->recv_buf + http->recv_len,
+                           RECV_BUF_SIZE - http->recv_len, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        http->recv_len += ret;
+    }
+    size_t header_len = end + 4 - http->recv_buf;
+    memcpy(headers, http->recv_buf, header_len - 2);
+    headers[header_len - 2] = '\0';
+    memmove(http->recv_buf, http->recv_buf + header_len, http->recv_len - header_len);
+    http->recv_len -= header_len;
+    return 0;
+}
+
+/*
+ * Receives exactly 'len' body bytes into 'buf'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int recv_body(http_io_t *http, char *buf, size_t len) {
+    size_t buffered = http->recv_len < len ? http->recv_len : len;
+    memcpy(buf, http->recv_buf, buffered);
+    memmove(http->recv_buf, http->recv_buf + buffered, http->recv_len - buffered);
+    http->recv_len -= buffered;
+    size_t done = buffered;
+    while (done < len) {
+        ssize_t ret = recv(http->sock, buf + done, len - done, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/*
+ * Returns the value of header 'name' in the response 'headers', or NULL
+ */
+static const char *find_header(const char *headers, const char *name) {
+    size_t name_len = strlen(name);
+    for (const char *line = strstr(headers, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            return value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Sends a request for 'len' bytes at 'offset' and stores the body in 'buf'
+ * Returns the number of bytes received, 0 if the range starts past the end,
+ * -1 if the connection failed (the request can be retried on a new connection),
+ * or -2 if the server refused the request or sent a response that cannot be used
+ */
+static ssize_t http_request(http_io_t *http, char *buf, size_t len, off_t offset) {
+    char request[MAX_REQUEST_LEN];
+    int request_len = snprintf(request, MAX_REQUEST_LEN,
+                               "GET %s HTTP/1.1\r\nHost: %s\r\nRange: bytes=%lld-%lld\r\n\r\n",
+                               http->path, http->host, (long long) offset,
+                               (long long) (offset + len - 1));
+    if (send_all(http->sock, request, request_len) != 0) {
+        return -1;
+    }
+    char headers[RECV_BUF_SIZE];
+    if (recv_headers(http, headers) != 0) {
+        return -1;
+    }
+
+    int status = 0;
+    sscanf(headers, "HTTP/%*s %d", &status);
+    const char *length_str = find_header(headers, "Content-Length");
+    long long content_length = length_str ? atoll(length_str) : 0;
+    const char *range_str = find_header(headers, "Content-Range");
+    long long range_start = -1;
+    long long range_end = -1;
+    if (range_str) {
+        sscanf(range_str, "bytes %lld-%lld", &range_start, &range_end);
+        const char *slash = strchr(range_str, '/');
+        if (slash && slash[1] != '*') {
+            http->size = atoll(slash + 1);
+        }
+    }
+    const char *encoding = find_header(headers, "Transfer-Encoding");
+    const char *connection = find_header(headers, "Connection");
+    // Without a Content-Length, the body only ends when the server closes the connection
+    int keep_alive = length_str && !(connection && strncasecmp(connection, "close", 5) == 0);
+
+    ssize_t ret;
+    if (status == 206) {
+        // Only plain bodies holding exactly the range we asked for can be used
+        long long range_len = range_end - range_start + 1;
+        if (encoding && strncasecmp(encoding, "identity", 8) != 0) {
+            printf("Archive server sent a response with unsupported transfer encoding\n");
+            http_disconnect(http);
+            errno = EIO;
+            return -2;
+        }
+        if (range_start != offset || range_end < range_start || range_len > len ||
+            (length_str && content_length != range_len)) {
+            printf("Archive server returned a different range than requested at offset %lld\n",
+                   (long long) offset);
+            http_disconnect(http);
+            errno = EIO;
+            return -2;
+        }
+        ret = recv_body(http, buf, range_len) == 0 ? range_len : -1;
+    } else if (status == 416) {
+        // Nothing at or past this offset, skip the error page the server sent
+        char discard[RECV_BUF_SIZE];
+        ret = 0;
+        while (content_length > 0 && ret == 0) {
+            size_t n = content_length < RECV_BUF_SIZE ? content_length : RECV_BUF_SIZE;
+            ret = recv_body(http, discard, n);
+            content_length -= n;
+        }
+    } else {
+        printf("Archive server did not return the requested range (status %d)\n", status);
+        // Not retryable, so report it as a hard error after dropping the connection
+        http_disconnect(http);
+        errno = EIO;
+        return -2;
+    }
+    if (!keep_alive) {
+        http_disconnect(http);
+    }
+    return ret;
+}
+
+/*
+ * Fetches up to 'len' bytes at 'offset' into 'buf', reusing the open connection
+ * if possible and reconnecting once if the server dropped it
+ * Returns the number of bytes received or -1 if an error occurs
+ */
+static ssize_t http_fetch(http_io_t *http, char *buf, size_t len, off_t offset) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused = http->sock >= 0;
+        if (!reused && http_connect(http) != 0) {
+            return -1;
+        }
+        ssize_t ret = http_request(http, buf, len, offset);
+        if (ret >= 0) {
+            return ret;
+        }
+        http_disconnect(http);
+        // Only a kept-alive connection that went stale is worth another try
+        if (ret == -2 || !reused) {
+            break;
+        }
+    }
+    printf("Failed to fetch bytes %lld-%lld of %s\n", (long long) offset,
+           (long long) (offset + len - 1), http->path);
+    return -1;
+}
+
+static ssize_t http_read_at(archive_io_t *io, void *buf, size_t len, off_t offset) {
+    http_io_t *http = (http_io_t *) io;
+    if (len == 0 || (http->size >= 0 && offset >= http->size)) {
+        return 0;
+    }
+
+    if (offset < http->cache_off || offset >= http->cache_off + (off_t) http->cache_len) {
+        // Grow the window while access stays sequential, start small after a jump
+        if (offset >= http->last_end && offset - http->last_end < (off_t) http->read_ahead) {
+            http->read_ahead *= 2;
+            if (http->read_ahead > MAX_READ_AHEAD) {
+                http->read_ahead = MAX_READ_AHEAD;
+            }
+        } else {
+            http->read_ahead = MIN_READ_AHEAD;
+        }
+        size_t fetch_len = len > http->read_ahead ? len : http->read_ahead;
+        if (fetch_len > MAX_READ_AHEAD) {
+            fetch_len = MAX_READ_AHEAD;
+        }
+        if (http->size >= 0 && offset + (off_t) fetch_len > http->size) {
+            fetch_len = http->size - offset;
+        }
+        ssize_t ret = http_fetch(http, http->cache, fetch_len, offset);
+        if (ret < 0) {
+            return -1;
+        }
+        http->cache_off = offset;
+        http->cache_len = ret;
+        http->last_end = offset + ret;
+        if (ret == 0) {
+            return 0;
+        }
+    }
+
+    size_t available = http->cache_off + http->cache_len - offset;
+    size_t n = len < available ? len : available;
+    memcpy(buf, http->cache + (offset - http->cache_off), n);
+    return n;
+}
+
+static int http_fd(archive_io_t *io) {
+    return -1;
+}
+
+static int http_close(archive_io_t *io) {
+    http_io_t *http = (http_io_t *) io;
+    http_disconnect(http);
+    free(http->cache);
+    free(http);
+    return 0;
+}
+
+archive_io_t *archive_io_open_http(const char *url) {
+    http_io_t *http = malloc(sizeof(http_io_t));
+    if (!http) {
+        return NULL;
+    }
+    memset(http, 0, sizeof(http_io_t));
+    http->sock = -1;
+    http->size = -1;
+    http->read_ahead = INITIAL_READ_AHEAD / 2;
+    if (parse_url(http, url) != 0) {
+        printf("Unsupported archive URL %s\n", url);
+        free(http);
+        return NULL;
+    }
+    http->cache = malloc(MAX_READ_AHEAD);
+    if (!http->cache) {
+        free(http);
+        return NULL;
+    }
+    http->ops.read_at = http_read_at;
+    http->ops.fd = http_fd;
+    http->ops.close = http_close;
+
+    // The first window holds the first headers, and its response tells us the size
+    char byte;
+    if (http_read_at(&http->ops, &byte, 1, 0) < 0 || http->size < 0) {
+        http_close(&http->ops);
+        return NULL;
+    }
+    return &http->ops;
+}
@@ -1,8 +1,12 @@
 #include "minitar.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
+#include <libgen.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,11 +14,25 @@
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "archive_io.h"
+#include "uring.h"
+
 #define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 128
 #define BLOCK_SIZE 512
+// Largest member size the 11 octal digits of a ustar size field can hold
+#define MAX_MEMBER_SIZE 077777777777LL
+#define COPY_CHUNK_SIZE (64 * 1024)
+// Members smaller than this are not worth handing to io_uring on their own
+#define URING_MIN_COPY_SIZE (4 * COPY_CHUNK_SIZE)
+// Most members handed to io_uring at once when writing an archive, which
+// bounds how many of their files are open at the same time
+#define URING_BATCH_SIZE 64
+// Minimum number of seconds between two progress updates
+#define PROGRESS_INTERVAL 0.5
 
 // Constants for tar compatibility information
 #define MAGIC "ustar"
@@ -24,6 +42,387 @@
 #define REGTYPE '0'
 #define DIRTYPE '5'
 
+// Options used by all archive operations, see minitar_set_options()
+static minitar_options_t options = {
+    .restore_metadata = 1,
+    .progress_fd = -1,
+    .sync = 1,
+};
+
+void minitar_options_init(minitar_options_t *opts) {
+    memset(opts, 0, sizeof(minitar_options_t));
+    opts->restore_metadata = 1;
+    opts->progress_fd = -1;
+    opts->sync = 1;
+}
+
+void minitar_set_options(const minitar_options_t *opts) {
+    options = *opts;
+}
+
+static const char *stats_phase_names[STATS_NUM_PHASES] = {
+    "open", "stat", "lookup", "read", "write", "seek", "metadata", "async_wait", "sync",
+};
+
+void minitar_stats_print_json(const minitar_stats_t *stats, FILE *fp) {
+    fprintf(fp, "{\"members\":%ld,\"phases\":{", stats->members);
+    for (int i = 0; i < STATS_NUM_PHASES; i++) {
+        const stats_phase_counters_t *phase = &stats->phases[i];
+        fprintf(fp, "%s\"%s\":{\"calls\":%ld,\"bytes\":%lld,\"wall_seconds\":%.6f,"
+                "\"cpu_seconds\":%.6f}",
+                i == 0 ? "" : ",", stats_phase_names[i], phase->calls, phase->bytes,
+                phase->wall_seconds, phase->cpu_seconds);
+    }
+    fprintf(fp, "},\"syscalls\":");
+    if (stats->read_syscalls < 0 || stats->write_syscalls < 0) {
+        fprintf(fp, "null}\n");
+    } else {
+        fprintf(fp, "{\"read\":%lld,\"write\":%lld}}\n", stats->read_syscalls,
+                stats->write_syscalls);
+    }
+}
+
+int minitar_read_syscall_counts(long long *reads, long long *writes) {
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (!fp) {
+        return -1;
+    }
+    char key[32];
+    long long value;
+    *reads = -1;
+    *writes = -1;
+    while (fscanf(fp, "%31[^:]: %lld\n", key, &value) == 2) {
+        if (strcmp(key, "syscr") == 0) {
+            *reads = value;
+        } else if (strcmp(key, "syscw") == 0) {
+            *writes = value;
+        }
+    }
+    fclose(fp);
+    return (*reads < 0 || *writes < 0) ? -1 : 0;
+}
+
+// Split archives are written by several threads, which share the counters below
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Start times of a call being measured for statistics
+typedef struct {
+    struct timespec wall;
+    struct timespec cpu;
+} stats_timer_t;
+
+static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Marks the start of a call to be measured. Does nothing if statistics are off.
+ */
+static void stats_start(stats_timer_t *timer) {
+    if (options.stats) {
+        clock_gettime(CLOCK_MONOTONIC, &timer->wall);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timer->cpu);
+    }
+}
+
+/*
+ * Charges the call started with stats_start() and the 'bytes' it moved to 'phase'
+ */
+static void stats_stop(const stats_timer_t *timer, stats_phase_t phase, long long bytes) {
+    if (options.stats) {
+        struct timespec wall, cpu;
+        clock_gettime(CLOCK_MONOTONIC, &wall);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        pthread_mutex_lock(&stats_lock);
+        stats_phase_counters_t *counters = &options.stats->phases[phase];
+        counters->calls++;
+        counters->bytes += bytes;
+        counters->wall_seconds += elapsed_seconds(&timer->wall, &wall);
+        counters->cpu_seconds += elapsed_seconds(&timer->cpu, &cpu);
+        pthread_mutex_unlock(&stats_lock);
+    }
+}
+
+/*
+ * Charges 'calls' calls that moved 'bytes' bytes and took the given time to 'phase'
+ */
+static void stats_add(stats_phase_t phase, long calls, long long bytes, double wall_seconds,
+                      double cpu_seconds) {
+    if (options.stats) {
+        pthread_mutex_lock(&stats_lock);
+        stats_phase_counters_t *counters = &options.stats->phases[phase];
+        counters->calls += calls;
+        counters->bytes += bytes;
+        counters->wall_seconds += wall_seconds;
+        counters->cpu_seconds += cpu_seconds;
+        pthread_mutex_unlock(&stats_lock);
+    }
+}
+
+static void stats_count_member(void) {
+    if (options.stats) {
+        options.stats->members++;
+    }
+}
+
+/*
+ * Wrappers around the I/O calls made by archive operations, which charge
+ * each call to its phase when statistics are enabled
+ */
+static FILE *timed_fopen(const char *path, const char *mode) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    FILE *fp = fopen(path, mode);
+    stats_stop(&timer, STATS_OPEN, 0);
+    return fp;
+}
+
+static int timed_fclose(FILE *fp) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fclose(fp);
+    stats_stop(&timer, STATS_OPEN, 0);
+    return ret;
+}
+
+static size_t timed_fread(void *ptr, size_t size, size_t nmemb, FILE *fp) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    size_t ret = fread(ptr, size, nmemb, fp);
+    stats_stop(&timer, STATS_READ, (long long) ret * size);
+    return ret;
+}
+
+static size_t timed_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *fp) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    size_t ret = fwrite(ptr, size, nmemb, fp);
+    stats_stop(&timer, STATS_WRITE, (long long) ret * size);
+    return ret;
+}
+
+static int timed_fflush(FILE *fp) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fflush(fp);
+    stats_stop(&timer, STATS_WRITE, 0);
+    return ret;
+}
+
+static int timed_fseek(FILE *fp, long offset, int whence) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fseek(fp, offset, whence);
+    stats_stop(&timer, STATS_SEEK, 0);
+    return ret;
+}
+
+static long timed_ftell(FILE *fp) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    long ret = ftell(fp);
+    stats_stop(&timer, STATS_SEEK, 0);
+    return ret;
+}
+
+static int timed_fdatasync(int fd) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fdatasync(fd);
+    stats_stop(&timer, STATS_SYNC, 0);
+    return ret;
+}
+
+static int timed_stat(const char *path, struct stat *stat_buf) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = stat(path, stat_buf);
+    stats_stop(&timer, STATS_STAT, 0);
+    return ret;
+}
+
+static int timed_fstat(int fd, struct stat *stat_buf) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fstat(fd, stat_buf);
+    stats_stop(&timer, STATS_STAT, 0);
+    return ret;
+}
+
+static int timed_truncate(const char *path, off_t length) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = truncate(path, length);
+    stats_stop(&timer, STATS_WRITE, 0);
+    return ret;
+}
+
+static int timed_fchown(int fd, uid_t uid, gid_t gid) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fchown(fd, uid, gid);
+    stats_stop(&timer, STATS_METADATA, 0);
+    return ret;
+}
+
+static int timed_fchmod(int fd, mode_t mode) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fchmod(fd, mode);
+    stats_stop(&timer, STATS_METADATA, 0);
+    return ret;
+}
+
+static int timed_futimens(int fd, const struct timespec times[2]) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = futimens(fd, times);
+    stats_stop(&timer, STATS_METADATA, 0);
+    return ret;
+}
+
+// Progress of the create, append or extract operation in flight
+static struct {
+    long long total_bytes;
+    long long done_bytes;
+    char member[sizeof(((tar_header *) 0)->name) + 1];
+    double start_time;
+    // Time and byte count of the last update, for the instantaneous rate
+    double last_time;
+    long long last_bytes;
+} progress;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Copies 'src' into 'dest' as the contents of a JSON string, escaping quotes,
+ * backslashes and control characters
+ */
+static void json_escape(char *dest, size_t dest_len, const char *src) {
+    size_t used = 0;
+    for (; *src && used + 7 < dest_len; src++) {
+        unsigned char c = *src;
+        if (c == '"' || c == '\\') {
+            dest[used++] = '\\';
+            dest[used++] = c;
+        } else if (c < 0x20) {
+            used += snprintf(dest + used, dest_len - used, "\\u%04x", c);
+        } else {
+            dest[used++] = c;
+        }
+    }
+    dest[used] = '\0';
+}
+
+/*
+ * Writes one progress update to the progress file descriptor
+ * 'finished' is nonzero for the final update of an operation
+ */
+static void progress_report(double now, int finished) {
+    double elapsed = now - progress.start_time;
+    double interval = now - progress.last_time;
+    double avg_rate = elapsed > 0 ? progress.done_bytes / elapsed : 0;
+    double rate = avg_rate;
+    if (!finished && interval > 0) {
+        rate = (progress.done_bytes - progress.last_bytes) / interval;
+    }
+    long long remaining = progress.total_bytes - progress.done_bytes;
+    double eta = remaining <= 0 ? 0 : avg_rate > 0 ? remaining / avg_rate : -1;
+    const char *member = progress.member;
+
+    if (options.progress_json) {
+        char name[4 * MAX_NAME_LEN];
+        json_escape(name, sizeof(name), member);
+        dprintf(options.progress_fd,
+                "{\"member\":\"%s\",\"bytes_done\":%lld,\"bytes_total\":%lld,"
+                "\"mb_per_s\":%.2f,\"avg_mb_per_s\":%.2f,\"eta_seconds\":%.1f,"
+                "\"finished\":%s}\n",
+                name, progress.done_bytes, progress.total_bytes, rate / (1 << 20),
+                avg_rate / (1 << 20), eta, finished ? "true" : "false");
+    } else {
+        int percent = progress.total_bytes > 0 ? progress.done_bytes * 100 / progress.total_bytes
+                                               : 100;
+        char eta_str[32] = "--:--:--";
+        if (eta >= 0) {
+            long secs = eta + 0.5;
+            snprintf(eta_str, sizeof(eta_str), "%ld:%02ld:%02ld", secs / 3600, secs / 60 % 60,
+                     secs % 60);
+        }
+        // Pad to overwrite any longer line left over from the previous update
+        dprintf(options.progress_fd,
+                "\r%-24.24s %10.1f / %.1f MiB %3d%% %8.1f MB/s (avg %.1f MB/s) ETA %s   %s",
+                member, progress.done_bytes / (double) (1 << 20),
+                progress.total_bytes / (double) (1 << 20), percent, rate / (1 << 20),
+                avg_rate / (1 << 20), eta_str, finished ? "\n" : "");
+    }
+    progress.last_time = now;
+    progress.last_bytes = progress.done_bytes;
+}
+
+/*
+ * Starts reporting progress for an operation that moves 'total_bytes' bytes
+ */
+static void progress_begin(long long total_bytes) {
+    if (options.progress_fd < 0) {
+        return;
+    }
+    memset(&progress, 0, sizeof(progress));
+    progress.total_bytes = total_bytes;
+    progress.start_time = now_seconds();
+    progress.last_time = progress.start_time;
+}
+
+static void progress_member(const char *member) {
+    if (options.progress_fd >= 0) {
+        pthread_mutex_lock(&progress_lock);
+        strncpy(progress.member, member, sizeof(progress.member) - 1);
+        pthread_mutex_unlock(&progress_lock);
+    }
+}
+
+/*
+ * Records 'nbytes' more bytes as done, reporting at most every PROGRESS_INTERVAL
+ * seconds so the copy loop calling this is not slowed down
+ */
+static void progress_advance(long long nbytes) {
+    if (options.progress_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&progress_lock);
+    progress.done_bytes += nbytes;
+    double now = now_seconds();
+    if (now - progress.last_time >= PROGRESS_INTERVAL) {
+        progress_report(now, 0);
+    }
+    pthread_mutex_unlock(&progress_lock);
+}
+
+static void progress_end(void) {
+    if (options.progress_fd >= 0) {
+        progress_report(now_seconds(), 1);
+    }
+}
+
+/*
+ * Sums the sizes of all files in 'files', as the total for progress reports
+ * Files that cannot be inspected count as empty; archiving them fails later anyway
+ */
+static long long total_file_size(const file_list_t *files) {
+    long long total = 0;
+    for (node_t *current = files->head; current; current = current->next) {
+        struct stat stat_buf;
+        if (timed_stat(current->name, &stat_buf) == 0) {
+            total += stat_buf.st_size;
+        }
+    }
+    return total;
+}
+
 /*
  * Helper function to compute the checksum of a tar header block
  * Performs a simple sum over all bytes in the header in accordance with POSIX
@@ -40,28 +439,62 @@ void compute_checksum(tar_header *header) {
     snprintf(header->chksum, 8, "%07o", sum);
 }
 
+/*
+ * Fills in every field of 'header' but the name and checksum for the file
+ * described by 'stat_buf', leaving out everything specific to the host: ids
+ * and names are zeroed, the mode is reduced to 0644 or 0755, and the mtime is
+ * fixed or clamped as set in the options. No user or group lookups are made.
+ */
+static void fill_normalized_fields(tar_header *header, const struct stat *stat_buf) {
+    snprintf(header->mode, 8, "%07o", stat_buf->st_mode & S_IXUSR ? 0755 : 0644);
+    snprintf(header->uid, 8, "%07o", 0);
+    snprintf(header->gid, 8, "%07o", 0);
+    snprintf(header->size, 12, "%011llo", (long long) stat_buf->st_size);
+    long long mtime = options.mtime;
+    if (options.clamp_mtime && stat_buf->st_mtime < mtime) {
+        mtime = stat_buf->st_mtime;
+    }
+    snprintf(header->mtime, 12, "%011o", (unsigned) mtime);
+    header->typeflag = REGTYPE;
+    strncpy(header->magic, MAGIC, 6);
+    memcpy(header->version, "00", 2);
+    snprintf(header->devmajor, 8, "%07o", 0);
+    snprintf(header->devminor, 8, "%07o", 0);
+}
+
 /*
  * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
+ * the file identified by 'file_name', as found by stat in 'file_stat'.
  * Returns 0 on success or -1 if an error occurs
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
+static int fill_tar_header_from_stat(tar_header *header, const char *file_name,
+                                     const struct stat *file_stat) {
     memset(header, 0, sizeof(tar_header));
     char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
+    struct stat stat_buf = *file_stat;
+
+    // Larger sizes would need tar's base-256 extension, which is not supported
+    if (stat_buf.st_size > MAX_MEMBER_SIZE) {
+        printf("File %s is too large to archive (%lld bytes, at most %lld)\n", file_name,
+               (long long) stat_buf.st_size, MAX_MEMBER_SIZE);
+        errno = EFBIG;
         return -1;
     }
 
     strncpy(header->name, file_name, 100);    // Name of the file, null-terminated string
+    if (options.reproducible) {
+        fill_normalized_fields(header, &stat_buf);
+        compute_checksum(header);
+        return 0;
+    }
     snprintf(header->mode, 8, "%07o",
              stat_buf.st_mode & 07777);    // Permissions for file, 0-padded octal
 
     snprintf(header->uid, 8, "%07o", stat_buf.st_uid);    // Owner ID of the file, 0-padded octal
+    stats_timer_t timer;
+    stats_start(&timer);
     struct passwd *pwd = getpwuid(stat_buf.st_uid);       // Look up name corresponding to owner ID
+    stats_stop(&timer, STATS_LOOKUP, 0);
     if (pwd == NULL) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
         perror(err_msg);
@@ -70,7 +503,9 @@ int fill_tar_header(tar_header *header, const char *file_name) {
     strncpy(header->uname, pwd->pw_name, 32);    // Owner name of the file, null-terminated string
 
     snprintf(header->gid, 8, "%07o", stat_buf.st_gid);    // Group ID of the file, 0-padded octal
+    stats_start(&timer);
     struct group *grp = getgrgid(stat_buf.st_gid);        // Look up name corresponding to group ID
+    stats_stop(&timer, STATS_LOOKUP, 0);
     if (grp == NULL) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
         perror(err_msg);
@@ -78,8 +513,8 @@ int fill_tar_header(tar_header *header, const char *file_name) {
     }
     strncpy(header->gname, grp->gr_name, 32);    // Group name of the file, null-terminated string
 
-    snprintf(header->size, 12, "%011o",
-             (unsigned) stat_buf.st_size);    // File size, 0-padded octal
+    snprintf(header->size, 12, "%011llo",
+             (long long) stat_buf.st_size);    // File size, 0-padded octal
     snprintf(header->mtime, 12, "%011o",
              (unsigned) stat_buf.st_mtime);    // Modification time, 0-padded octal
     header->typeflag = REGTYPE;                // File type, always regular file in this project
@@ -94,6 +529,23 @@ int fill_tar_header(tar_header *header, const char *file_name) {
     return 0;
 }
 
+/*
+ * Populates a tar header block pointed to by 'header' with metadata about
+ * the file identified by 'file_name'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fill_tar_header(tar_header *header, const char *file_name) {
+    char err_msg[MAX_MSG_LEN];
+    struct stat stat_buf;
+    // stat is a system call to inspect file metadata
+    if (timed_stat(file_name, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
+        perror(err_msg);
+        return -1;
+    }
+    return fill_tar_header_from_stat(header, file_name, &stat_buf);
+}
+
 /*
  * Removes 'nbytes' bytes from the file identified by 'file_name'
  * Returns 0 upon success, -1 upon error
@@ -103,7 +555,7 @@ int remove_trailing_bytes(const char *file_name, size_t nbytes) {
     char err_msg[MAX_MSG_LEN];
 
     struct stat stat_buf;
-    if (stat(file_name, &stat_buf) != 0) {
+    if (timed_stat(file_name, &stat_buf) != 0) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
         perror(err_msg);
         return -1;
@@ -116,7 +568,7 @@ int remove_trailing_bytes(const char *file_name, size_t nbytes) {
         file_size -= nbytes;
     }
 
-    if (truncate(file_name, file_size) != 0) {
+    if (timed_truncate(file_name, file_size) != 0) {
         snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
         perror(err_msg);
         return -1;
@@ -128,14 +580,12 @@ int remove_trailing_bytes(const char *file_name, size_t nbytes) {
  * Obtain the size of current file.
  * Must be use after fopen()
  */
-int get_size(FILE *fp) {
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    if (size < 0) {
+off_t get_size(FILE *fp) {
+    struct stat stat_buf;
+    if (timed_fstat(fileno(fp), &stat_buf) != 0) {
         return -1;
     }
-    return size;
+    return stat_buf.st_size;
 }
 
 /*
@@ -150,411 +600,1459 @@ int allZeros(const char arr[], int size) {
     return 1;
 }
 
-int create_archive(const char *archive_name, const file_list_t *files) {
-    // Create archive file
-    FILE *afp = fopen(archive_name, "w");
-    if (!afp) {
-        perror("Archive file fopen error: ");
+// Callbacks from the io_uring engine feeding statistics and progress reports.
+// 'arg' holds the member name of each segment, or is NULL.
+static void uring_io_done(void *arg, int is_write, long long nbytes) {
+    stats_add(is_write ? STATS_WRITE : STATS_READ, 1, nbytes, 0, 0);
+}
+
+static void uring_written(void *arg, int segment, long long data_bytes) {
+    if (arg) {
+        progress_member(((const char **) arg)[segment]);
+    }
+    progress_advance(data_bytes);
+}
+
+static void uring_waited(void *arg, double wall_seconds, double cpu_seconds) {
+    stats_add(STATS_ASYNC_WAIT, 1, 0, wall_seconds, cpu_seconds);
+}
+
+/*
+ * Writes the 'count' segments to the current position of 'out' through
+ * io_uring, then moves 'out' past them. 'names' gives the member name of
+ * each segment for progress reports, or is NULL.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_segments_uring(const uring_segment_t *segments, int count, const char **names,
+                                FILE *out) {
+    // Hand any buffered output to the kernel first so offsets line up
+    if (timed_fflush(out) != 0) {
+        perror("Data fflush error");
+        return -1;
+    }
+    long out_off = timed_ftell(out);
+    if (out_off < 0) {
+        perror("Data ftell error");
+        return -1;
+    }
+    long long size = 0;
+    for (int i = 0; i < count; i++) {
+        size += segments[i].header_len + segments[i].size + segments[i].pad;
+    }
+    uring_callbacks_t callbacks = {uring_io_done, uring_written, uring_waited, names};
+    if (uring_write_segments(segments, count, fileno(out), out_off, &callbacks) != 0) {
         return -1;
     }
+    // The writes used explicit offsets, so reposition the stream past the data
+    if (timed_fseek(out, out_off + size, SEEK_SET) != 0) {
+        perror("Data fseek error");
+        return -1;
+    }
+    return 0;
+}
 
-    node_t *current = files->head;
-    // Iterate through all specified files
-    while (current) {
-        // Generate a header
-        tar_header header;
-        if (fill_tar_header(&header, current->name) == 0) {
-            if (fwrite(&header, BLOCK_SIZE, 1, afp) != 1) {
-                perror("Header fwrite error: ");
-                if (fclose(afp)) {
-                    perror("Error in closing archive file.");
-                }
-                return -1;
-            }
-        } else {
-            perror("Fill tar header error");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
-            return -1;
-        }
+/*
+ * Copies 'size' bytes at offset 'in_off' of the file descriptor 'in_fd' to the
+ * current position of 'out' through io_uring, then moves 'out' past the data
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_data_uring(int in_fd, off_t in_off, FILE *out, long long size) {
+    uring_segment_t segment = {.in_fd = in_fd, .in_off = in_off, .size = size};
+    return write_segments_uring(&segment, 1, NULL, out);
+}
 
-        // Open the current file prepare for read
-        FILE *cfp = fopen(current->name, "r");
-        if (!cfp) {
-            perror("Current file fopen error: ");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+/*
+ * Reads 'len' bytes at 'offset' from the archive behind 'io', retrying short reads
+ * Returns the number of bytes read, which is less than 'len' only at the end of
+ * the archive, or -1 if an error occurs
+ */
+static ssize_t io_read_full(archive_io_t *io, void *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        stats_timer_t timer;
+        stats_start(&timer);
+        ssize_t ret = io->read_at(io, (char *) buf + done, len - done, offset + done);
+        stats_stop(&timer, STATS_READ, ret > 0 ? ret : 0);
+        if (ret < 0) {
             return -1;
         }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
 
-        // Obtain the size of current file.
-        int size = get_size(cfp);
-        if (size < 0) {
-            printf("Error happend in checking the size of current file.\n");
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+/*
+ * Copies 'size' bytes at 'offset' of the archive behind 'io' to 'out', in
+ * chunks of COPY_CHUNK_SIZE bytes or through io_uring for large local members
+ * Returns 0 on success or -1 if an error occurs (including the archive ending early)
+ */
+static int copy_from_archive(archive_io_t *io, off_t offset, long long size, FILE *out) {
+    static char buffer[COPY_CHUNK_SIZE];
+    int fd = io->fd(io);
+    if (fd >= 0 && options.use_io_uring && size >= URING_MIN_COPY_SIZE && uring_init() == 0) {
+        return copy_data_uring(fd, offset, out, size);
+    }
+    while (size > 0) {
+        size_t chunk = size < COPY_CHUNK_SIZE ? size : COPY_CHUNK_SIZE;
+        ssize_t num_read = io_read_full(io, buffer, chunk, offset);
+        if (num_read != chunk) {
+            if (num_read < 0) {
+                perror("Archive data read error");
+            } else {
+                printf("Unexpected end of file while copying data\n");
             }
             return -1;
         }
-
-        // Create a buffer that every byte is initially zero, ensure buffer size is multiple of 512
-        int adjust_size = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
-        char *buffer = (char *) malloc(adjust_size);
-        if (!buffer) {
-            perror("Failed to allocate");
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+        if (timed_fwrite(buffer, 1, num_read, out) != num_read) {
+            perror("Data fwrite error");
             return -1;
         }
-        memset(buffer, 0, adjust_size);
+        offset += num_read;
+        size -= num_read;
+        progress_advance(num_read);
+    }
+    return 0;
+}
 
-        // Read and write the current file
-        fread(buffer, 1, adjust_size, cfp);
-        // If the fread isn't successful
-        if (ferror(cfp)) {
-            perror("Current file fread Error:");
-            free(buffer);
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+/*
+ * Copies 'size' bytes from 'in' to 'out' in chunks of COPY_CHUNK_SIZE bytes,
+ * then writes 'pad' zero bytes to 'out'. Copying in chunks keeps memory use
+ * constant no matter how big the member is.
+ * Returns 0 on success or -1 if an error occurs (including 'in' ending early)
+ */
+int copy_data(FILE *in, FILE *out, off_t size, int pad) {
+    static char buffer[COPY_CHUNK_SIZE];
+    while (size > 0) {
+        size_t chunk = size < COPY_CHUNK_SIZE ? size : COPY_CHUNK_SIZE;
+        size_t num_read = timed_fread(buffer, 1, chunk, in);
+        if (num_read != chunk) {
+            if (ferror(in)) {
+                perror("Data fread error");
+            } else {
+                printf("Unexpected end of file while copying data\n");
             }
             return -1;
         }
-        if (fwrite(buffer, 1, adjust_size, afp) != adjust_size) {
-            perror("Current file fwrite Error:");
-            free(buffer);
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+        if (timed_fwrite(buffer, 1, num_read, out) != num_read) {
+            perror("Data fwrite error");
             return -1;
         }
-
-        free(buffer);
-        if (fclose(cfp)) {
-            perror("Error in closing current file.");
+        size -= num_read;
+        progress_advance(num_read);
+    }
+    if (pad > 0) {
+        memset(buffer, 0, pad);
+        if (timed_fwrite(buffer, 1, pad, out) != pad) {
+            perror("Padding fwrite error");
             return -1;
         }
-        current = current->next;
-    }
-    // Adds two-block footer to archive
-    char footer[1024] = {0};
-    if (fwrite(footer, BLOCK_SIZE, 2, afp) < 2) {
-        perror("Footer fwrite error");
-        fclose(afp);
-        return -1;
-    }
-    if (fclose(afp)) {
-        perror("Error in closing archive file.");
-        return -1;
     }
     return 0;
 }
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
-    // Make sure the archive file actually exists first
-    FILE *fp = fopen(archive_name, "r");
-    if (!fp) {
-        printf("archive not exist!\n");
-        return -1;
+/*
+ * Returns the process's umask. It is read once and then cached, since reading
+ * it means setting it, which would race with threads creating files.
+ */
+static mode_t current_umask(void) {
+    static mode_t mask;
+    static int known = 0;
+    if (!known) {
+        mask = umask(0);
+        umask(mask);
+        known = 1;
     }
-    if (fclose(fp)) {
-        perror("Error in closing archive file.");
-        return -1;
+    return mask;
+}
+
+/*
+ * Applies the owner, permissions and modification time of 'member', as parsed
+ * from its header, to the already-open file descriptor 'fd' of its extracted file.
+ * Working on the descriptor avoids another path lookup per metadata syscall.
+ * Ownership is only restored when running as root, like tar does. Other users
+ * get the mode with their umask applied and without setuid/setgid bits, as
+ * tar does unless asked to preserve permissions.
+ * Must be called after all data has been written to 'fd', otherwise later
+ * writes would bump the modification time again.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int restore_file_metadata(int fd, const minitar_member_t *member) {
+    char err_msg[MAX_MSG_LEN + sizeof(member->name)];
+    const char *file_name = member->name;
+    mode_t mode = member->mode;
+    if (geteuid() != 0) {
+        mode &= ~(current_umask() | S_ISUID | S_ISGID);
     }
 
-    // Remove old footer in archive file
-    if (remove_trailing_bytes(archive_name, 1024) == -1) {
-        printf("Error happened in remove trailing bytes\n");
+    // Change owner first, since fchown may clear the setuid/setgid bits
+    if (geteuid() == 0 && timed_fchown(fd, member->uid, member->gid) != 0) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to restore owner of file %s", file_name);
+        perror(err_msg);
         return -1;
     }
-
-    // Start to write in archive file
-    FILE *afp = fopen(archive_name, "a");
-    if (!afp) {
-        perror("Archive file fopen error: ");
+    if (timed_fchmod(fd, mode) != 0) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to restore mode of file %s", file_name);
+        perror(err_msg);
         return -1;
     }
-    node_t *current = files->head;
-    while (current) {
-        // Generate a header
-        tar_header header;
-        if (fill_tar_header(&header, current->name) == 0) {
-            if (fwrite(&header, BLOCK_SIZE, 1, afp) != 1) {
-                perror("Header fwrite error: ");
-                if (fclose(afp)) {
-                    perror("Error in closing archive file.");
-                }
-                return -1;
-            }
-        } else {
-            perror("Fill tar header error");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
-            return -1;
-        }
-        FILE *cfp = fopen(current->name, "r");
-        if (!cfp) {
-            perror("Current file fopen error: ");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
-            return -1;
-        }
+    // The archive records no access time, so that becomes the time of extraction
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = member->mtime;
+    times[1].tv_nsec = 0;
+    if (timed_futimens(fd, times) != 0) {
+        snprintf(err_msg, sizeof(err_msg), "Failed to restore mtime of file %s", file_name);
+        perror(err_msg);
+        return -1;
+    }
+    return 0;
+}
 
-        // Obtain the file size
-        int size = get_size(cfp);
+/*
+ * Writes the headers and zero-padded contents of the 'count' files starting
+ * at 'first' to the current position of 'afp' in a single io_uring run, so
+ * reading one member overlaps writing the ones before it, then moves 'afp'
+ * past them. If 'held_header' is not NULL, the first header is stored there
+ * instead and its block is skipped.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_member_batch(FILE *afp, const node_t *first, int count,
+                              tar_header *held_header) {
+    static tar_header headers[URING_BATCH_SIZE];
+    uring_segment_t segments[URING_BATCH_SIZE];
+    const char *names[URING_BATCH_SIZE];
+    FILE *cfps[URING_BATCH_SIZE];
+    int opened = 0;
+    int failed = 0;
+    // Generate every header and open every file first
+    for (const node_t *current = first; opened < count; current = current->next) {
+        if (fill_tar_header(&headers[opened], current->name) != 0) {
+            perror("Fill tar header error");
+            failed = 1;
+            break;
+        }
+        FILE *cfp = timed_fopen(current->name, "r");
+        if (!cfp) {
+            perror("Current file fopen error: ");
+            failed = 1;
+            break;
+        }
+        cfps[opened] = cfp;
+        names[opened] = current->name;
+        off_t size = get_size(cfp);
         if (size < 0) {
             printf("Error happend in checking the size of current file.\n");
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
+            opened++;
+            failed = 1;
+            break;
+        }
+        segments[opened].header = &headers[opened];
+        segments[opened].header_len = BLOCK_SIZE;
+        segments[opened].in_fd = fileno(cfp);
+        segments[opened].in_off = 0;
+        segments[opened].size = size;
+        segments[opened].pad = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+        opened++;
+    }
+    if (!failed && held_header) {
+        *held_header = headers[0];
+        segments[0].header_len = 0;
+        if (timed_fseek(afp, BLOCK_SIZE, SEEK_CUR) != 0) {
+            perror("Archive file fseek error");
+            failed = 1;
+        }
+    }
+    if (!failed && write_segments_uring(segments, count, names, afp) != 0) {
+        failed = 1;
+    }
+    for (int i = 0; i < opened; i++) {
+        if (timed_fclose(cfps[i])) {
+            perror("Error in closing current file.");
+            failed = 1;
+        }
+    }
+    if (failed) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        stats_count_member();
+    }
+    return 0;
+}
+
+/*
+ * Writes a header followed by the zero-padded contents of each file in 'files'
+ * to 'afp', starting at its current position. Does not close 'afp'.
+ * If 'held_header' is not NULL, the header of the first file is stored there
+ * instead of being written, and its block is left for the caller to fill.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_members(FILE *afp, const file_list_t *files, tar_header *held_header) {
+    progress_begin(options.progress_fd >= 0 ? total_file_size(files) : 0);
+    node_t *current = files->head;
+    // With io_uring, members go through the ring in batches instead
+    if (options.use_io_uring && uring_init() == 0) {
+        while (current) {
+            int count = 0;
+            const node_t *first = current;
+            for (; current && count < URING_BATCH_SIZE; current = current->next) {
+                count++;
+            }
+            if (write_member_batch(afp, first, count, held_header) != 0) {
+                return -1;
             }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+            held_header = NULL;
+        }
+    }
+    // Iterate through all specified files
+    while (current) {
+        // Generate a header
+        tar_header header;
+        if (fill_tar_header(&header, current->name) != 0) {
+            perror("Fill tar header error");
+            return -1;
+        }
+        if (held_header) {
+            *held_header = header;
+            held_header = NULL;
+            if (timed_fseek(afp, BLOCK_SIZE, SEEK_CUR) != 0) {
+                perror("Archive file fseek error");
+                return -1;
             }
+        } else if (timed_fwrite(&header, BLOCK_SIZE, 1, afp) != 1) {
+            perror("Header fwrite error: ");
             return -1;
         }
 
-        // Create a buffer that every byte is initially zero, ensure buffer size is multiple of 512
-        int adjust_size = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
-        char *buffer = (char *) malloc(adjust_size);
-        if (!buffer) {
-            perror("Failed to malloc buffer");
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+        // Open the current file prepare for read
+        FILE *cfp = timed_fopen(current->name, "r");
+        if (!cfp) {
+            perror("Current file fopen error: ");
             return -1;
         }
-        memset(buffer, 0, adjust_size);
 
-        // Read and write the current file
-        fread(buffer, 1, size, cfp);
-        if (ferror(cfp)) {
-            perror("Current file fread Error:");
-            free(buffer);
-            if (fclose(cfp)) {
+        // Obtain the size of current file.
+        off_t size = get_size(cfp);
+        if (size < 0) {
+            printf("Error happend in checking the size of current file.\n");
+            if (timed_fclose(cfp)) {
                 perror("Error in closing current file.");
             }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
             return -1;
         }
-        if (fwrite(buffer, 1, adjust_size, afp) != adjust_size) {
-            perror("Current file fwrite Error:");
-            free(buffer);
-            if (fclose(cfp)) {
+
+        // Copy the file's contents, zero-padded to a multiple of 512 bytes
+        int pad = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+        progress_member(current->name);
+        if (copy_data(cfp, afp, size, pad) != 0) {
+            if (timed_fclose(cfp)) {
                 perror("Error in closing current file.");
             }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
             return -1;
         }
-        free(buffer);
-        if (fclose(cfp)) {
+        if (timed_fclose(cfp)) {
             perror("Error in closing current file.");
+            return -1;
         }
+        stats_count_member();
         current = current->next;
     }
-    // Create the 2 blocks footer
-    char footer[1024] = {0};
-    if (fwrite(footer, BLOCK_SIZE, 2, afp) < 2) {
+    progress_end();
+    return 0;
+}
+
+/*
+ * Writes the two-block footer that ends every archive to 'afp'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_footer(FILE *afp) {
+    char footer[NUM_TRAILING_BLOCKS * BLOCK_SIZE] = {0};
+    if (timed_fwrite(footer, BLOCK_SIZE, NUM_TRAILING_BLOCKS, afp) < NUM_TRAILING_BLOCKS) {
         perror("Footer fwrite error");
-        if (fclose(afp)) {
-            perror("Error in closing archive file.");
-        }
         return -1;
     }
-    if (fclose(afp)) {
-        perror("Error in closing archive file.");
+    return 0;
+}
+
+/*
+ * Hands everything buffered for 'afp' to the kernel and, unless syncing is
+ * turned off in the options, waits until its data is on stable storage
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int sync_archive(FILE *afp) {
+    if (timed_fflush(afp) != 0) {
+        perror("Archive file fflush error");
+        return -1;
+    }
+    if (options.sync && timed_fdatasync(fileno(afp)) != 0) {
+        perror("Archive file fdatasync error");
         return -1;
     }
     return 0;
 }
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
-    // If archive file not exist
-    FILE *afp = fopen(archive_name, "r");
+/*
+ * Creates an empty file with permissions 'mode' in the same directory as
+ * 'file_name', and stores its name in 'temp_name' (PATH_MAX bytes).
+ * Returns its file descriptor, or -1 if an error occurs
+ */
+static int create_temp_file(const char *file_name, char *temp_name, mode_t mode) {
+    if (snprintf(temp_name, PATH_MAX, "%s.XXXXXX", file_name) >= PATH_MAX) {
+        printf("Archive name %s is too long\n", file_name);
+        return -1;
+    }
+    stats_timer_t timer;
+    stats_start(&timer);
+    int fd = mkstemp(temp_name);
+    stats_stop(&timer, STATS_OPEN, 0);
+    if (fd < 0) {
+        perror("Temporary archive file mkstemp error");
+        return -1;
+    }
+
+    // mkstemp always uses mode 0600
+    if (fchmod(fd, mode) != 0) {
+        perror("Temporary archive file setup error");
+        close(fd);
+        unlink(temp_name);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Syncs the directory containing 'file_name', so renames into it survive a crash
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int sync_parent_dir(const char *file_name) {
+    char dir_name[PATH_MAX];
+    strncpy(dir_name, file_name, PATH_MAX - 1);
+    dir_name[PATH_MAX - 1] = '\0';
+    int dir_fd = open(dirname(dir_name), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+        perror("Archive directory open error");
+        return -1;
+    }
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = fsync(dir_fd);
+    stats_stop(&timer, STATS_SYNC, 0);
+    if (ret != 0) {
+        perror("Archive directory fsync error");
+    }
+    close(dir_fd);
+    return ret == 0 ? 0 : -1;
+}
+
+/*
+ * Stores in 'target' (PATH_MAX bytes) the file that writing 'archive_name'
+ * replaces. If 'archive_name' is a symbolic link, that is the file it points
+ * to, so the link itself survives the rename.
+ * Returns 1 and fills 'target_stat' if the file exists, 0 if it does not,
+ * or -1 if an error occurs
+ */
+static int resolve_archive_target(const char *archive_name, char *target,
+                                  struct stat *target_stat) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = stat(archive_name, target_stat);
+    stats_stop(&timer, STATS_STAT, 0);
+    if (ret != 0) {
+        if (errno != ENOENT) {
+            perror("Archive file stat error");
+            return -1;
+        }
+        if (strlen(archive_name) >= PATH_MAX) {
+            printf("Archive name %s is too long\n", archive_name);
+            return -1;
+        }
+        strcpy(target, archive_name);
+        return 0;
+    }
+    if (!realpath(archive_name, target)) {
+        perror("Archive file realpath error");
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Creates an empty file in the same directory as 'archive_name' to build a
+ * replacement archive in, and stores its name in 'temp_name' (PATH_MAX bytes).
+ * If 'existing' is not NULL, the file gets the mode of the archive it
+ * describes, and its owner too when running as root, so renaming it over
+ * that archive keeps them.
+ * Returns the file opened for writing, or NULL if an error occurs
+ */
+static FILE *open_temp_archive(const char *archive_name, char *temp_name,
+                               const struct stat *existing) {
+    // Without an archive to match, use the mode fopen would give a new file
+    mode_t mode = existing ? existing->st_mode & 07777 : 0666 & ~current_umask();
+    int fd = create_temp_file(archive_name, temp_name, mode);
+    if (fd < 0) {
+        return NULL;
+    }
+    // fchown may clear the setuid/setgid bits, so set the mode again after it
+    if (existing && geteuid() == 0 &&
+        (fchown(fd, existing->st_uid, existing->st_gid) != 0 || fchmod(fd, mode) != 0)) {
+        perror("Temporary archive file setup error");
+        close(fd);
+        unlink(temp_name);
+        return NULL;
+    }
+    FILE *afp = fdopen(fd, "w");
     if (!afp) {
-        perror("Archive file fopen error: ");
+        perror("Temporary archive file setup error");
+        close(fd);
+        unlink(temp_name);
+    }
+    return afp;
+}
+
+/*
+ * Closes and removes the unfinished archive 'afp' created by open_temp_archive()
+ */
+static void discard_temp_archive(FILE *afp, const char *temp_name) {
+    if (timed_fclose(afp)) {
+        perror("Error in closing archive file.");
+    }
+    if (unlink(temp_name) != 0) {
+        perror("Failed to remove temporary archive file");
+    }
+}
+
+/*
+ * Makes the complete archive 'afp' created by open_temp_archive() durable with a
+ * single fdatasync, then atomically renames it to 'archive_name'. Readers see
+ * either the old archive or the complete new one, never anything in between.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int commit_temp_archive(FILE *afp, const char *temp_name, const char *archive_name) {
+    if (sync_archive(afp) != 0) {
+        discard_temp_archive(afp, temp_name);
+        return -1;
+    }
+    if (timed_fclose(afp)) {
+        perror("Error in closing archive file.");
+        unlink(temp_name);
         return -1;
     }
+    if (rename(temp_name, archive_name) != 0) {
+        perror("Archive file rename error");
+        unlink(temp_name);
+        return -1;
+    }
+    // Sync the directory too, so the rename itself survives a crash
+    return options.sync ? sync_parent_dir(archive_name) : 0;
+}
+
+/*
+ * Parses the octal number in the header field 'field' of 'len' bytes, which
+ * may fill the whole field without a terminator
+ * Returns the value, or -1 if the field does not start with a number
+ */
+static long long parse_octal_field(const char *field, size_t len) {
+    char buf[16];
+    if (len >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+    memcpy(buf, field, len);
+    buf[len] = '\0';
+    char *end;
+    long long value = strtoll(buf, &end, 8);
+    return end == buf ? -1 : value;
+}
 
-    //  Read the first file name
-    char file_name[100] = {0};
-    fread(file_name, 1, 100, afp);
-    if (ferror(afp)) {
-        perror("Achieve file fread name Error:");
-        if (fclose(afp)) {
-            perror("Error in closing archive file.");
+// Copies the header string field 'field' of 'len' bytes into 'dest', terminating it
+static void copy_string_field(char *dest, const char *field, size_t len) {
+    memcpy(dest, field, len);
+    dest[len] = '\0';
+}
+
+// One member of a split archive, placed within the archive before any part is written
+typedef struct {
+    const char *name;
+    tar_header header;
+    long long size;
+    // Offset of the member's header within the whole archive
+    long long offset;
+} planned_member_t;
+
+// Layout of a split archive, shared by the threads writing its parts
+typedef struct {
+    const char *archive_name;
+    planned_member_t *members;
+    int num_members;
+    // Size of the whole archive, footer included
+    long long archive_size;
+    // Offset of each part within the whole archive, plus 'archive_size' at the end
+    long long *part_starts;
+    int num_parts;
+    // Temporary file each part is written to, before all are renamed at once,
+    // and the permissions each gets, worked out before any thread starts
+    char **temp_names;
+    mode_t part_mode;
+    // Next part for a worker to write and whether any part failed, under 'lock'
+    int next_part;
+    int failed;
+    pthread_mutex_t lock;
+} split_plan_t;
+
+// Most threads writing parts of a split archive at the same time
+#define MAX_SPLIT_THREADS 16
+
+// Offset just past the zero-padded data of 'member'
+static long long member_end(const planned_member_t *member) {
+    return member->offset + BLOCK_SIZE + (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+}
+
+/*
+ * Builds the header of each file in 'files' and places it, its data and the
+ * footer within the whole archive, then cuts the archive into parts of at most
+ * 'options.split_size' bytes. Only the headers are kept in memory.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int plan_split_archive(split_plan_t *plan, const file_list_t *files) {
+    plan->members = calloc(files->size, sizeof(planned_member_t));
+    if (!plan->members) {
+        perror("Failed to allocate");
+        return -1;
+    }
+    long long offset = 0;
+    for (node_t *current = files->head; current; current = current->next) {
+        planned_member_t *member = &plan->members[plan->num_members++];
+        member->name = current->name;
+        struct stat stat_buf;
+        if (timed_stat(current->name, &stat_buf) != 0) {
+            perror("Current file stat error");
+            return -1;
         }
+        if (fill_tar_header_from_stat(&member->header, current->name, &stat_buf) != 0) {
+            perror("Fill tar header error");
+            return -1;
+        }
+        // Taken from stat rather than parsed back from the header
+        member->size = stat_buf.st_size;
+        member->offset = offset;
+        offset = member_end(member);
+    }
+    plan->archive_size = offset + NUM_TRAILING_BLOCKS * BLOCK_SIZE;
+
+    long long part_size = options.split_size / BLOCK_SIZE * BLOCK_SIZE;
+    if (part_size < BLOCK_SIZE) {
+        printf("Split size must be at least %d bytes\n", BLOCK_SIZE);
         return -1;
     }
-    // Add each file name to the file list
-    int offset = 0;
-    while (!allZeros(file_name, 100)) {
-        if (file_list_add(files, file_name) == 1) {
-            printf("Fail to add file in file list\n");
-            file_list_clear(files);
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+    // Enough for block boundaries; member boundaries never need more parts than that
+    int max_parts = (plan->archive_size + part_size - 1) / part_size + plan->num_members + 1;
+    plan->part_starts = malloc((max_parts + 1) * sizeof(long long));
+    if (!plan->part_starts) {
+        perror("Failed to allocate");
+        return -1;
+    }
+    plan->part_starts[0] = 0;
+    if (!options.split_at_members) {
+        for (offset = part_size; offset < plan->archive_size; offset += part_size) {
+            plan->part_starts[++plan->num_parts] = offset;
+        }
+    } else {
+        // Start a new part before each member (or the footer) that would overflow the current one
+        for (int i = 0; i <= plan->num_members; i++) {
+            long long start = i < plan->num_members ? plan->members[i].offset : offset;
+            long long end = i < plan->num_members ? member_end(&plan->members[i])
+                                                  : plan->archive_size;
+            if (end - start > part_size) {
+                printf("Member %s does not fit in a part of %lld bytes\n",
+                       i < plan->num_members ? plan->members[i].name : "footer", part_size);
+                return -1;
+            }
+            if (end - plan->part_starts[plan->num_parts] > part_size) {
+                plan->part_starts[++plan->num_parts] = start;
             }
+        }
+    }
+    plan->part_starts[++plan->num_parts] = plan->archive_size;
+
+    plan->temp_names = calloc(plan->num_parts, sizeof(char *));
+    if (!plan->temp_names) {
+        perror("Failed to allocate");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes all 'len' bytes of 'buf' at 'offset' of the file descriptor 'fd'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_all_at(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        stats_timer_t timer;
+        stats_start(&timer);
+        ssize_t ret = pwrite(fd, buf, len, offset);
+        stats_stop(&timer, STATS_WRITE, ret > 0 ? ret : 0);
+        if (ret < 0) {
             return -1;
         }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
 
-        // Get the size of current file
-        char size[12];
-        fseek(afp, 24, SEEK_CUR);
-        fread(size, 1, 12, afp);
-        if (ferror(afp)) {
-            perror("Achieve file fread size Error:");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+/*
+ * Fills the part file 'fd' with bytes 'start' to 'end' of the archive laid out
+ * in 'plan': slices of headers, member data read straight from the members'
+ * files, and zeros for padding and the footer
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_part_data(const split_plan_t *plan, int fd, long long start, long long end,
+                           char *buffer) {
+    // Find the member 'start' falls in, or past the last one if it is in the footer
+    int i = 0;
+    while (i < plan->num_members && member_end(&plan->members[i]) <= start) {
+        i++;
+    }
+    int member_fd = -1;
+    long long pos = start;
+    while (pos < end) {
+        const planned_member_t *member = i < plan->num_members ? &plan->members[i] : NULL;
+        long long data_start = member ? member->offset + BLOCK_SIZE : 0;
+        long long data_end = member ? data_start + member->size : 0;
+        long long region_end = member ? member_end(member) : plan->archive_size;
+        const char *src = buffer;
+        size_t len;
+        if (member && pos < data_start) {
+            // Part of the header
+            len = (data_start < end ? data_start : end) - pos;
+            src = (const char *) &member->header + (pos - member->offset);
+        } else if (member && pos < data_end) {
+            long long stop = data_end < end ? data_end : end;
+            len = stop - pos < COPY_CHUNK_SIZE ? stop - pos : COPY_CHUNK_SIZE;
+            if (member_fd < 0) {
+                progress_member(member->name);
+                stats_timer_t timer;
+                stats_start(&timer);
+                member_fd = open(member->name, O_RDONLY);
+                stats_stop(&timer, STATS_OPEN, 0);
+                if (member_fd < 0) {
+                    perror("Current file open error");
+                    return -1;
+                }
             }
-            return -1;
+            stats_timer_t timer;
+            stats_start(&timer);
+            ssize_t num_read = pread(member_fd, buffer, len, pos - data_start);
+            stats_stop(&timer, STATS_READ, num_read > 0 ? num_read : 0);
+            if (num_read <= 0) {
+                if (num_read < 0) {
+                    perror("Current file read error");
+                } else {
+                    printf("Unexpected end of file while copying data\n");
+                }
+                close(member_fd);
+                return -1;
+            }
+            len = num_read;
+            progress_advance(len);
+        } else {
+            // Padding after the data, or the footer
+            long long stop = region_end < end ? region_end : end;
+            len = stop - pos < COPY_CHUNK_SIZE ? stop - pos : COPY_CHUNK_SIZE;
+            memset(buffer, 0, len);
         }
-        int int_size;
-        int result = sscanf(size, "%o", &int_size);
-        if (result != 1) {
-            printf("Failed to convert int size\n");
-            file_list_clear(files);
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+        if (write_all_at(fd, src, len, pos - start) != 0) {
+            perror("Archive part write error");
+            if (member_fd >= 0) {
+                close(member_fd);
             }
             return -1;
         }
+        pos += len;
+        if (member && pos >= region_end) {
+            if (member_fd >= 0) {
+                close(member_fd);
+                member_fd = -1;
+            }
+            i++;
+        }
+    }
+    if (member_fd >= 0) {
+        close(member_fd);
+    }
+    return 0;
+}
 
-        // Relocate the archive file pointer at the next header's name
-        int block_num = (int_size + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
-        offset += block_num * BLOCK_SIZE;
-        fseek(afp, offset, SEEK_SET);
+/*
+ * Writes part 'part' of the archive laid out in 'plan' to a new temporary file
+ * and syncs it, unless syncing is turned off in the options
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_part(split_plan_t *plan, int part, char *buffer) {
+    char part_name[PATH_MAX];
+    char temp_name[PATH_MAX];
+    if (snprintf(part_name, sizeof(part_name), ARCHIVE_PART_NAME_FORMAT, plan->archive_name,
+                 part) >= sizeof(part_name)) {
+        printf("Archive name %s is too long\n", plan->archive_name);
+        return -1;
+    }
+    int fd = create_temp_file(part_name, temp_name, plan->part_mode);
+    if (fd < 0) {
+        return -1;
+    }
+    plan->temp_names[part] = strdup(temp_name);
+    if (!plan->temp_names[part]) {
+        perror("Failed to allocate");
+        close(fd);
+        unlink(temp_name);
+        return -1;
+    }
+    int ret = write_part_data(plan, fd, plan->part_starts[part], plan->part_starts[part + 1],
+                              buffer);
+    if (ret == 0 && options.sync && timed_fdatasync(fd) != 0) {
+        perror("Archive part fdatasync error");
+        ret = -1;
+    }
+    if (close(fd) != 0) {
+        perror("Error in closing archive part.");
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Worker thread: writes parts of the archive in 'arg' until none are left or one fails
+ */
+static void *split_worker(void *arg) {
+    split_plan_t *plan = arg;
+    char *buffer = malloc(COPY_CHUNK_SIZE);
+    if (!buffer) {
+        perror("Failed to allocate");
+        pthread_mutex_lock(&plan->lock);
+        plan->failed = 1;
+        pthread_mutex_unlock(&plan->lock);
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&plan->lock);
+        int part = !plan->failed && plan->next_part < plan->num_parts ? plan->next_part++ : -1;
+        pthread_mutex_unlock(&plan->lock);
+        if (part < 0) {
+            break;
+        }
+        if (write_part(plan, part, buffer) != 0) {
+            pthread_mutex_lock(&plan->lock);
+            plan->failed = 1;
+            pthread_mutex_unlock(&plan->lock);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Writes the list of the parts of 'plan' and their sizes, which readers need
+ * before they treat the parts as one archive, and makes it durable
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_part_list(const split_plan_t *plan, const char *list_name) {
+    char temp_name[PATH_MAX];
+    FILE *fp = open_temp_archive(list_name, temp_name, NULL);
+    if (!fp) {
+        return -1;
+    }
+    int ret = fprintf(fp, "%d\n", plan->num_parts);
+    for (int part = 0; ret >= 0 && part < plan->num_parts; part++) {
+        ret = fprintf(fp, "%lld\n", plan->part_starts[part + 1] - plan->part_starts[part]);
+    }
+    if (ret < 0) {
+        perror("Archive part list write error");
+        discard_temp_archive(fp, temp_name);
+        return -1;
+    }
+    return commit_temp_archive(fp, temp_name, list_name);
+}
 
-        fread(file_name, 1, 100, afp);
-        if (ferror(afp)) {
-            perror("Achieve file fread name Error:");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
+/*
+ * Renames every written part of 'plan' to its final name and removes what is
+ * left of an older archive of the same name: the unsplit archive and any parts
+ * beyond the new last one. The old part list goes first and the new one is
+ * written last, so a crash in between leaves parts that readers refuse, not
+ * a mix of old and new parts that reads as one damaged archive. The older
+ * archive is lost in that case.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int commit_split_archive(const split_plan_t *plan) {
+    char part_name[PATH_MAX];
+    char list_name[PATH_MAX];
+    if (snprintf(list_name, sizeof(list_name), ARCHIVE_PART_LIST_FORMAT, plan->archive_name) >=
+        sizeof(list_name)) {
+        printf("Archive name %s is too long\n", plan->archive_name);
+        return -1;
+    }
+    if (unlink(list_name) != 0 && errno != ENOENT) {
+        perror("Failed to remove old archive part list");
+        return -1;
+    }
+    // The old list must be gone for good before any of its parts is replaced
+    if (options.sync && sync_parent_dir(plan->archive_name) != 0) {
+        return -1;
+    }
+    for (int part = 0; part < plan->num_parts; part++) {
+        snprintf(part_name, sizeof(part_name), ARCHIVE_PART_NAME_FORMAT, plan->archive_name, part);
+        if (rename(plan->temp_names[part], part_name) != 0) {
+            perror("Archive part rename error");
+            return -1;
+        }
+    }
+    if (unlink(plan->archive_name) != 0 && errno != ENOENT) {
+        perror("Failed to remove old archive");
+        return -1;
+    }
+    for (int part = plan->num_parts;; part++) {
+        snprintf(part_name, sizeof(part_name), ARCHIVE_PART_NAME_FORMAT, plan->archive_name, part);
+        if (unlink(part_name) != 0) {
+            if (errno == ENOENT) {
+                break;
             }
+            perror("Failed to remove old archive part");
             return -1;
         }
     }
-    if (fclose(afp)) {
-        perror("Error in closing archive file.");
+    // Syncing the directory for the list also makes the renames above durable
+    return write_part_list(plan, list_name);
+}
+
+static void free_split_plan(split_plan_t *plan) {
+    for (int part = 0; plan->temp_names && part < plan->num_parts; part++) {
+        free(plan->temp_names[part]);
+    }
+    free(plan->temp_names);
+    free(plan->part_starts);
+    free(plan->members);
+    pthread_mutex_destroy(&plan->lock);
+}
+
+/*
+ * Creates the archive 'archive_name' as parts of at most 'options.split_size'
+ * bytes. Since every member's position is known from the plan, the parts do not
+ * depend on each other and worker threads write them in parallel.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int create_split_archive(const char *archive_name, const file_list_t *files) {
+    split_plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.archive_name = archive_name;
+    // Reading the umask means setting it, which must not race with the workers
+    plan.part_mode = 0666 & ~current_umask();
+    pthread_mutex_init(&plan.lock, NULL);
+    if (plan_split_archive(&plan, files) != 0) {
+        free_split_plan(&plan);
+        return -1;
+    }
+
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads > plan.num_parts) {
+        num_threads = plan.num_parts;
+    }
+    if (num_threads > MAX_SPLIT_THREADS) {
+        num_threads = MAX_SPLIT_THREADS;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    long long total_size = 0;
+    for (int i = 0; i < plan.num_members; i++) {
+        total_size += plan.members[i].size;
+    }
+    pthread_t threads[MAX_SPLIT_THREADS];
+    int started = 0;
+    progress_begin(total_size);
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, split_worker, &plan) != 0) {
+            perror("Failed to start archive part writer");
+            break;
+        }
+    }
+    // With no thread started, write every part on this one
+    if (started == 0) {
+        split_worker(&plan);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    progress_end();
+
+    int ret = plan.failed ? -1 : commit_split_archive(&plan);
+    if (ret != 0) {
+        for (int part = 0; part < plan.num_parts; part++) {
+            if (plan.temp_names[part]) {
+                unlink(plan.temp_names[part]);
+            }
+        }
+    } else {
+        for (int i = 0; i < plan.num_members; i++) {
+            stats_count_member();
+        }
+    }
+    free_split_plan(&plan);
+    return ret;
+}
+
+static int compare_node_names(const void *a, const void *b) {
+    return strncmp(((const node_t *) a)->name, ((const node_t *) b)->name, MAX_NAME_LEN);
+}
+
+/*
+ * Copies the nodes of 'files' into a single allocation, sorted by name, and
+ * links them into 'sorted'. Release it with free(sorted->head), not file_list_clear().
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int sort_file_list(const file_list_t *files, file_list_t *sorted) {
+    file_list_init(sorted);
+    if (files->size == 0) {
+        return 0;
+    }
+    node_t *nodes = malloc(files->size * sizeof(node_t));
+    if (!nodes) {
+        perror("Failed to allocate");
         return -1;
     }
+    int i = 0;
+    for (node_t *current = files->head; current; current = current->next) {
+        nodes[i++] = *current;
+    }
+    qsort(nodes, files->size, sizeof(node_t), compare_node_names);
+    for (i = 0; i < files->size - 1; i++) {
+        nodes[i].next = &nodes[i + 1];
+    }
+    nodes[files->size - 1].next = NULL;
+    sorted->head = nodes;
+    sorted->size = files->size;
     return 0;
 }
 
-int extract_files_from_archive(const char *archive_name) {
-    // Get archive file list
-    file_list_t files;
-    file_list_init(&files);
-    if (get_archive_file_list(archive_name, &files) == -1) {
+/*
+ * Writes a single-file archive of 'files' to a temporary file and renames it
+ * over 'archive_name', or the file it links to, once complete
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int create_single_archive(const char *archive_name, const file_list_t *files) {
+    char target[PATH_MAX];
+    struct stat target_stat;
+    int exists = resolve_archive_target(archive_name, target, &target_stat);
+    if (exists < 0) {
         return -1;
     }
-    // Open the archive file
-    FILE *afp = fopen(archive_name, "r");
+    // Build the archive under a temporary name first, so a crash part way
+    // through leaves any existing archive of the same name untouched
+    char temp_name[PATH_MAX];
+    FILE *afp = open_temp_archive(target, temp_name, exists ? &target_stat : NULL);
     if (!afp) {
-        perror("Archive file fopen error: ");
         return -1;
     }
+    if (write_members(afp, files, NULL) != 0 || write_footer(afp) != 0) {
+        discard_temp_archive(afp, temp_name);
+        return -1;
+    }
+    return commit_temp_archive(afp, temp_name, target);
+}
 
-    node_t *current = files.head;
-    FILE *cfp;
-    while (current) {
-        cfp = fopen(current->name, "w");
-        if (!cfp) {
-            perror("Current file fopen error: ");
-            file_list_clear(&files);
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+int create_archive(const char *archive_name, const file_list_t *files) {
+    if (archive_io_is_remote(archive_name)) {
+        printf("Cannot write to remote archive %s\n", archive_name);
+        return -1;
+    }
+    // Members go in name order so the output does not depend on argument order
+    file_list_t sorted;
+    if (options.reproducible) {
+        if (sort_file_list(files, &sorted) != 0) {
             return -1;
         }
+        files = &sorted;
+    }
+    int ret = options.split_size > 0 ? create_split_archive(archive_name, files)
+                                     : create_single_archive(archive_name, files);
+    if (options.reproducible) {
+        free(sorted.head);
+    }
+    return ret;
+}
 
-        // Get the size of current file
-        char size[12];
-        fseek(afp, 124, SEEK_CUR);
-        fread(size, 1, 12, afp);
-        if (ferror(afp)) {
-            perror("Achieve file fread size Error:");
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+// Called by scan_archive() for each member, returns 0 to keep scanning
+typedef int (*member_callback_t)(archive_io_t *io, const minitar_member_t *member, void *arg);
+
+/*
+ * Opens the archive 'archive_name' for reading with the matching I/O backend
+ * Returns NULL if an error occurs
+ */
+static archive_io_t *open_archive_io(const char *archive_name) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    archive_io_t *io = archive_io_open(archive_name);
+    stats_stop(&timer, STATS_OPEN, 0);
+    if (!io) {
+        perror("Archive file open error");
+    }
+    return io;
+}
+
+static int close_archive_io(archive_io_t *io) {
+    stats_timer_t timer;
+    stats_start(&timer);
+    int ret = io->close(io);
+    stats_stop(&timer, STATS_OPEN, 0);
+    if (ret != 0) {
+        perror("Error in closing archive file.");
+    }
+    return ret;
+}
+
+/*
+ * Walks the headers of the archive behind 'io' in order and calls 'callback'
+ * for each member. Member data is skipped over, never read. Scanning stops at
+ * the footer, or at the end of an archive that is missing its footer.
+ * Returns 0 on success, or -1 if an error occurs or a callback returns nonzero
+ */
+static int scan_archive(archive_io_t *io, member_callback_t callback, void *arg) {
+    long long offset = 0;
+    while (1) {
+        minitar_member_t member;
+        ssize_t num_read = io_read_full(io, &member.header, BLOCK_SIZE, offset);
+        if (num_read < 0) {
+            perror("Archive header read error");
             return -1;
         }
-        int int_size;
-        int result = sscanf(size, "%o", &int_size);
-        if (result != 1) {
+        if (num_read < BLOCK_SIZE || allZeros(member.header.name, 100)) {
+            return 0;
+        }
+
+        member.size = parse_octal_field(member.header.size, sizeof(member.header.size));
+        if (member.size < 0) {
             printf("Failed to convert int size\n");
-            file_list_clear(&files);
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
             return -1;
         }
-        // Assign the pointer after the header block
-        fseek(afp, 512 - 136, SEEK_CUR);
+        member.mtime = parse_octal_field(member.header.mtime, sizeof(member.header.mtime));
+        member.mode = parse_octal_field(member.header.mode, sizeof(member.header.mode)) & 07777;
+        member.uid = parse_octal_field(member.header.uid, sizeof(member.header.uid));
+        member.gid = parse_octal_field(member.header.gid, sizeof(member.header.gid));
+        member.typeflag = member.header.typeflag;
+        copy_string_field(member.name, member.header.name, sizeof(member.header.name));
+        copy_string_field(member.uname, member.header.uname, sizeof(member.header.uname));
+        copy_string_field(member.gname, member.header.gname, sizeof(member.header.gname));
+        member.offset = offset;
+        member.data_offset = offset + BLOCK_SIZE;
 
-        // Read and write the file into current working directory
-        char *buffer = malloc(int_size);
-        if (!buffer) {
-            perror("Failed to malloc buffer");
-            file_list_clear(&files);
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+        if (callback(io, &member, arg) != 0) {
             return -1;
         }
-        int num_read = fread(buffer, 1, int_size, afp);
-        if (fwrite(buffer, 1, num_read, cfp) != num_read) {
-            perror("Current file fwrite Error:");
-            file_list_clear(&files);
-            free(buffer);
-            if (fclose(cfp)) {
-                perror("Error in closing current file.");
-            }
-            if (fclose(afp)) {
-                perror("Error in closing archive file.");
-            }
+        // Skip the header and the member's data, padded to a whole block
+        offset = member.data_offset + (member.size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+}
+
+static int add_member_name(archive_io_t *io, const minitar_member_t *member, void *arg) {
+    stats_count_member();
+    if (file_list_add((file_list_t *) arg, member->name) == 1) {
+        printf("Fail to add file in file list\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int add_member_size(archive_io_t *io, const minitar_member_t *member, void *arg) {
+    *(long long *) arg += member->size;
+    return 0;
+}
+
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+    archive_io_t *io = open_archive_io(archive_name);
+    if (!io) {
+        return -1;
+    }
+    int ret = scan_archive(io, add_member_name, files);
+    if (ret != 0) {
+        file_list_clear(files);
+    }
+    if (close_archive_io(io) != 0) {
+        return -1;
+    }
+    return ret;
+}
+
+// The caller's callback and argument, passed through scan_archive() by iterate_archive()
+typedef struct {
+    minitar_member_callback_t callback;
+    void *arg;
+} iteration_t;
+
+static int call_member_callback(archive_io_t *io, const minitar_member_t *member, void *arg) {
+    iteration_t *iteration = arg;
+    stats_count_member();
+    return iteration->callback(member, iteration->arg);
+}
+
+int iterate_archive(const char *archive_name, minitar_member_callback_t callback, void *arg) {
+    archive_io_t *io = open_archive_io(archive_name);
+    if (!io) {
+        return -1;
+    }
+    iteration_t iteration = {callback, arg};
+    int ret = scan_archive(io, call_member_callback, &iteration);
+    if (close_archive_io(io) != 0) {
+        return -1;
+    }
+    return ret;
+}
+
+// Called by scan_archive() for each member, keeps the offset where its data ends
+static int note_member_end(archive_io_t *io, const minitar_member_t *member, void *arg) {
+    *(long long *) arg =
+        member->data_offset + (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return 0;
+}
+
+/*
+ * Adds the members in 'files' to the existing single-file archive 'archive_name'
+ * in place of its footer. The old archive stays readable until one block write:
+ * the new members and footer go after the first block of the old footer, which
+ * keeps ending the archive, and only once they are synced does the first new
+ * header replace that block. The second sync makes that block durable too, so
+ * the archive is appended to when the function returns.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int append_members(const char *archive_name, const file_list_t *files) {
+    // Make sure the archive file actually exists first
+    FILE *fp = timed_fopen(archive_name, "r");
+    if (!fp) {
+        printf("archive not exist!\n");
+        return -1;
+    }
+    if (timed_fclose(fp)) {
+        perror("Error in closing archive file.");
+        return -1;
+    }
+    if (files->size == 0) {
+        return 0;
+    }
+
+    // Find where the old footer starts. Scanning, rather than going back from
+    // the end of the file, also skips anything an interrupted append left there.
+    archive_io_t *io = open_archive_io(archive_name);
+    if (!io) {
+        return -1;
+    }
+    long long footer_offset = 0;
+    int ret = scan_archive(io, note_member_end, &footer_offset);
+    if (close_archive_io(io) != 0 || ret != 0) {
+        return -1;
+    }
+
+    // Not opened in "a" mode, since O_APPEND would ignore the explicit offsets
+    // used by the io_uring copy path
+    FILE *afp = timed_fopen(archive_name, "r+");
+    if (!afp) {
+        perror("Archive file fopen error: ");
+        return -1;
+    }
+    tar_header first_header;
+    if (timed_fseek(afp, footer_offset, SEEK_SET) != 0 ||
+        write_members(afp, files, &first_header) != 0 || write_footer(afp) != 0 ||
+        sync_archive(afp) != 0) {
+        if (timed_fclose(afp)) {
+            perror("Error in closing archive file.");
+        }
+        return -1;
+    }
+    // Drop whatever an interrupted append left past the new footer
+    long end = timed_ftell(afp);
+    if (end < 0 || timed_truncate(archive_name, end) != 0) {
+        perror("Archive file truncate error");
+        if (timed_fclose(afp)) {
+            perror("Error in closing archive file.");
+        }
+        return -1;
+    }
+    // Link the new members into the archive
+    if (timed_fseek(afp, footer_offset, SEEK_SET) != 0 ||
+        timed_fwrite(&first_header, BLOCK_SIZE, 1, afp) != 1 || sync_archive(afp) != 0) {
+        perror("Header fwrite error");
+        if (timed_fclose(afp)) {
+            perror("Error in closing archive file.");
+        }
+        return -1;
+    }
+    if (timed_fclose(afp)) {
+        perror("Error in closing archive file.");
+        return -1;
+    }
+    return 0;
+}
+
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    if (archive_io_is_remote(archive_name)) {
+        printf("Cannot write to remote archive %s\n", archive_name);
+        return -1;
+    }
+    file_list_t sorted;
+    if (options.reproducible) {
+        if (sort_file_list(files, &sorted) != 0) {
             return -1;
         }
-        free(buffer);
-        if (fclose(cfp)) {
+        files = &sorted;
+    }
+    int ret = append_members(archive_name, files);
+    if (options.reproducible) {
+        free(sorted.head);
+    }
+    return ret;
+}
+
+/*
+ * Writes the data of 'member' to a new file of the same name in the current
+ * working directory and restores its metadata if enabled in the options
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_member(archive_io_t *io, const minitar_member_t *member, void *arg) {
+    // Replace rather than overwrite an existing file, like tar, since an earlier
+    // version of the member may have been restored without write permission
+    if (unlink(member->name) != 0 && errno != ENOENT) {
+        perror("Failed to remove existing file");
+        return -1;
+    }
+    FILE *cfp = timed_fopen(member->name, "w");
+    if (!cfp) {
+        perror("Current file fopen error: ");
+        return -1;
+    }
+
+    // Copy the member's contents into the new file
+    progress_member(member->name);
+    if (copy_from_archive(io, member->data_offset, member->size, cfp) != 0) {
+        if (timed_fclose(cfp)) {
             perror("Error in closing current file.");
+        }
+        return -1;
+    }
+
+    // Flush buffered data first so the restored mtime is the final one
+    if (options.restore_metadata) {
+        if (timed_fflush(cfp) != 0 ||
+            restore_file_metadata(fileno(cfp), member) != 0) {
+            perror("Error in restoring file metadata.");
+            if (timed_fclose(cfp)) {
+                perror("Error in closing current file.");
+            }
             return -1;
         }
+    }
+    if (timed_fclose(cfp)) {
+        perror("Error in closing current file.");
+        return -1;
+    }
+    stats_count_member();
+    return 0;
+}
 
-        // Point to the multiple of 512 if file's size isn't a multiple of 512
-        int offset = (BLOCK_SIZE - int_size % BLOCK_SIZE) % BLOCK_SIZE;
-        fseek(afp, offset, SEEK_CUR);
-        current = current->next;
+int extract_files_from_archive(const char *archive_name) {
+    archive_io_t *io = open_archive_io(archive_name);
+    if (!io) {
+        return -1;
     }
-    file_list_clear(&files);
-    if (fclose(afp)) {
-        perror("Error in closing archive file.");
+
+    // Only scan twice when the total is needed for progress reports
+    long long total_size = 0;
+    int ret = 0;
+    if (options.progress_fd >= 0) {
+        ret = scan_archive(io, add_member_size, &total_size);
+    }
+
+    // Later versions of a member overwrite the earlier ones as the scan reaches them
+    if (ret == 0) {
+        progress_begin(total_size);
+        ret = scan_archive(io, extract_member, NULL);
+        progress_end();
+    }
+    if (close_archive_io(io) != 0) {
         return -1;
     }
+    return ret;
+}
+
+// Latest version of each member named in a list, filled in by find_selected()
+typedef struct {
+    const file_list_t *names;
+    minitar_member_t *latest;
+    int *found;
+} selection_t;
+
+static int find_selected(archive_io_t *io, const minitar_member_t *member, void *arg) {
+    selection_t *selection = arg;
+    int i = 0;
+    for (node_t *current = selection->names->head; current; current = current->next, i++) {
+        if (strcmp(current->name, member->name) == 0) {
+            selection->latest[i] = *member;
+            selection->found[i] = 1;
+        }
+    }
     return 0;
 }
+
+static int compare_data_offsets(const void *a, const void *b) {
+    long long offset_a = ((const minitar_member_t *) a)->data_offset;
+    long long offset_b = ((const minitar_member_t *) b)->data_offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+int extract_selected_files_from_archive(const char *archive_name, const file_list_t *files) {
+    selection_t selection;
+    selection.names = files;
+    selection.latest = malloc(files->size * sizeof(minitar_member_t));
+    selection.found = calloc(files->size, sizeof(int));
+    if (!selection.latest || !selection.found) {
+        perror("Failed to allocate");
+        free(selection.latest);
+        free(selection.found);
+        return -1;
+    }
+    archive_io_t *io = open_archive_io(archive_name);
+    if (!io) {
+        free(selection.latest);
+        free(selection.found);
+        return -1;
+    }
+
+    // Find where the latest version of each member is, then read only those
+    int ret = scan_archive(io, find_selected, &selection);
+    long long total_size = 0;
+    int i = 0;
+    for (node_t *current = files->head; ret == 0 && current; current = current->next, i++) {
+        if (!selection.found[i]) {
+            printf("%s is not present in the archive\n", current->name);
+            ret = -1;
+        } else {
+            total_size += selection.latest[i].size;
+        }
+    }
+    if (ret == 0) {
+        // Extract in archive order so reads move forward through the archive
+        qsort(selection.latest, files->size, sizeof(minitar_member_t), compare_data_offsets);
+        progress_begin(total_size);
+        for (i = 0; ret == 0 && i < files->size; i++) {
+            ret = extract_member(io, &selection.latest[i], NULL);
+        }
+        progress_end();
+    }
+
+    free(selection.latest);
+    free(selection.found);
+    if (close_archive_io(io) != 0) {
+        return -1;
+    }
+    return ret;
+}
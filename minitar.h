@@ -2,6 +2,10 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
 #include "file_list.h"
 
 // Standard tar header layout defined by POSIX
@@ -41,6 +45,135 @@ typedef struct {
     char padding[12];
 } tar_header;
 
+// One member of an archive, with the fields of its header parsed
+typedef struct {
+    // Member's name, user name and group name, as null-terminated strings
+    char name[101];
+    char uname[33];
+    char gname[33];
+    // Size of the member's data in bytes
+    long long size;
+    time_t mtime;
+    // Permission bits only, the file type is in 'typeflag'
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    char typeflag;
+    // Offsets of the member's header and of its data within the archive
+    long long offset;
+    long long data_offset;
+    // The header exactly as stored in the archive
+    tar_header header;
+} minitar_member_t;
+
+// Called by iterate_archive() for each member
+// Returns 0 to continue with the next member, or nonzero to stop
+typedef int (*minitar_member_callback_t)(const minitar_member_t *member, void *arg);
+
+// Kinds of work that archive operations are broken down into for statistics
+typedef enum {
+    STATS_OPEN,          // Opening and closing archives and member files
+    STATS_STAT,          // stat calls on member files and archives
+    STATS_LOOKUP,        // Owner and group name lookups (getpwuid, getgrgid)
+    STATS_READ,          // Reads from member files and archives, incl. header scans
+    STATS_WRITE,         // Writes and truncation of member files and archives
+    STATS_SEEK,          // Seeks within member files and archives
+    STATS_METADATA,      // Restoring owner, mode and mtime of extracted files
+    STATS_ASYNC_WAIT,    // Submitting and waiting for io_uring reads and writes
+    STATS_SYNC,          // Flushing written archives to stable storage
+    STATS_NUM_PHASES
+} stats_phase_t;
+
+// Counters for one phase of work
+typedef struct {
+    // Number of library or system calls made in this phase
+    long calls;
+    // Bytes moved by those calls (reads and writes only)
+    long long bytes;
+    // Elapsed wall clock time and CPU time of this thread, in seconds
+    double wall_seconds;
+    double cpu_seconds;
+} stats_phase_counters_t;
+
+// Statistics collected by archive operations when enabled through the options
+typedef struct {
+    stats_phase_counters_t phases[STATS_NUM_PHASES];
+    // Number of members written to, listed from or extracted from archives
+    long members;
+    // Read and write syscalls the process made while the statistics were
+    // collected, as counted by the kernel, or -1 if unavailable. The phase call
+    // counts are of stdio calls, which buffering may turn into fewer syscalls.
+    long long read_syscalls;
+    long long write_syscalls;
+} minitar_stats_t;
+
+// Options that tune how the archive operations below behave
+typedef struct {
+    // If nonzero, extraction restores each member's mode and mtime (and its
+    // owner when running as root) from the archive header
+    int restore_metadata;
+    // If non-NULL, archive operations add their statistics to '*stats'.
+    // Statistics are not collected when NULL, which costs almost nothing.
+    minitar_stats_t *stats;
+    // If not -1, create, append and extract report their progress on this file
+    // descriptor: as JSON lines if 'progress_json' is nonzero, otherwise as a
+    // single self-updating line meant for a terminal
+    int progress_fd;
+    int progress_json;
+    // If nonzero, copy large members with io_uring, keeping several reads and
+    // writes in flight. Falls back to plain reads and writes if io_uring is
+    // not available.
+    int use_io_uring;
+    // If nonzero, created and appended archives are flushed to stable storage
+    // with fdatasync before the operation returns
+    int sync;
+    // If nonzero, create writes the archive as parts of at most this many
+    // bytes (rounded down to whole blocks) named "ARCHIVE.000", "ARCHIVE.001",
+    // and so on, which together hold one archive. Parts are cut at any block
+    // boundary, so a member may continue in the next part, unless
+    // 'split_at_members' is nonzero, in which case parts end only between members.
+    long long split_size;
+    int split_at_members;
+    // If nonzero, create and append write the same bytes for the same file
+    // names and contents on any host: members are sorted by name, ids, user
+    // and group names and device numbers are zeroed (without looking names
+    // up), modes become 0644 or 0755, and every mtime is 'mtime', or the
+    // file's own mtime if earlier and 'clamp_mtime' is nonzero
+    int reproducible;
+    long long mtime;
+    int clamp_mtime;
+} minitar_options_t;
+
+/*
+ * Populates 'opts' with the default option values.
+ */
+void minitar_options_init(minitar_options_t *opts);
+
+/*
+ * Use the options in 'opts' for all subsequent archive operations.
+ * The options are copied, so 'opts' does not need to outlive this call.
+ */
+void minitar_set_options(const minitar_options_t *opts);
+
+/*
+ * Writes the statistics in 'stats' to 'fp' as a single JSON object.
+ */
+void minitar_stats_print_json(const minitar_stats_t *stats, FILE *fp);
+
+/*
+ * Reads the kernel's counts of the read and write syscalls made so far by
+ * this process from /proc/self/io (io_uring requests are not included).
+ * Returns 0 on success or -1 if the counts are unavailable
+ */
+int minitar_read_syscall_counts(long long *reads, long long *writes);
+
+/*
+ * Archives are read through the I/O backends in 'archive_io.h'. Wherever an
+ * archive is only read (listing and extracting), 'archive_name' may also be an
+ * http:// URL of a server supporting range requests, or the name of an archive
+ * split into parts (see the 'split_size' option), which is read as one stream.
+ */
+
 /*
  * Create a new archive file with the name 'archive_name'.
  * The archive should contain all files stored in the 'files' list.
@@ -48,6 +181,12 @@ typedef struct {
  * You may also assume that all the elements of 'files' exist.
  * If an archive of the specified name already exists, you should overwrite it
  * with the result of this operation.
+ * The archive is written to a temporary file in the same directory, synced
+ * (unless disabled through the 'sync' option) and then renamed over
+ * 'archive_name', so an existing archive is only replaced by a complete one.
+ * With the 'split_size' option, the archive's layout is planned up front from
+ * the members' sizes and its parts are written in parallel by worker threads.
+ * Each part goes through the same temporary file and rename steps.
  * This function should return 0 upon success or -1 if an error occurred
  */
 int create_archive(const char *archive_name, const file_list_t *files);
@@ -56,6 +195,8 @@ int create_archive(const char *archive_name, const file_list_t *files);
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
  * You can assume in this project that at least one new file to append is specified.
  * You may also assume that all files to be appended exist.
+ * The new members are synced to disk before the new footer is written
+ * (unless disabled through the 'sync' option).
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int append_files_to_archive(const char *archive_name, const file_list_t *files);
@@ -69,14 +210,35 @@ int append_files_to_archive(const char *archive_name, const file_list_t *files);
  */
 int get_archive_file_list(const char *archive_name, file_list_t *files);
 
+/*
+ * Call 'callback' with each member of the archive identified by 'archive_name',
+ * in archive order, as soon as its header is read. Only the current member is
+ * held in memory, so this suits archives too large to collect into a list.
+ * This function returns 0 upon success or -1 if an error occurred or the
+ * callback stopped the iteration early.
+ */
+int iterate_archive(const char *archive_name, minitar_member_callback_t callback, void *arg);
+
 /*
  * Write each file contained within the archive identified by 'archive_name'
  * as a new file to the current working directory.
  * If there are multiple versions of the same file present in the archive,
  * then only the most recently added version should be present as a new file
  * at the end of the extraction process.
+ * Unless disabled through the 'restore_metadata' option, each extracted file
+ * gets the permissions and modification time recorded in its header, and
+ * also its owner if the caller is root.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Like extract_files_from_archive(), but only writes the most recent version
+ * of each member named in 'files'. Only the headers and the data of those
+ * versions are read, which matters for remote archives.
+ * This function returns 0 upon success or -1 if an error occurred, including
+ * when one of the named members is not present in the archive.
+ */
+int extract_selected_files_from_archive(const char *archive_name, const file_list_t *files);
+
 #endif    // _MINITAR_H
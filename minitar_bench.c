@@ -0,0 +1,445 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Benchmark driver for the archive operations in minitar.c
+//
+// Generates synthetic datasets in a scratch directory and times each archive
+// operation on them. Every operation runs in its own child process so that
+// peak RSS and syscall counts belong to that operation alone. Results are
+// printed to stdout as one JSON object per line.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_list.h"
+#include "minitar.h"
+
+#define ARCHIVE_NAME "bench.tar"
+#define EXTRACT_DIR "extract"
+#define MAX_PATH_LEN 256
+// Size of a tar header, the only part of each member that list reads
+#define HEADER_SIZE 512
+
+// Shape of one synthetic dataset
+typedef struct {
+    const char *name;
+    // Number of member files
+    int num_files;
+    // Member sizes are spread between these bounds (inclusive)
+    long min_size;
+    long max_size;
+    // Spread sizes logarithmically instead of linearly between the bounds
+    int log_sizes;
+    // How many files each update round refreshes, and how many rounds to run
+    int update_files;
+    int update_rounds;
+} dataset_t;
+
+static const dataset_t datasets[] = {
+    {"many_small", 2000, 512, 4096, 0, 20, 1},
+    {"few_huge", 4, 32L << 20, 64L << 20, 0, 1, 1},
+    {"mixed", 300, 0, 8L << 20, 1, 10, 1},
+    {"deep_history", 4, 16L << 10, 64L << 10, 0, 1, 200},
+};
+
+// Measurements taken inside the child process running an operation
+typedef struct {
+    double seconds;
+    // CPU time of the timed region only, so preparation is not counted
+    double user_seconds;
+    double sys_seconds;
+    long members;
+    long long bytes;
+    long long read_syscalls;
+    long long write_syscalls;
+    int status;
+} op_result_t;
+
+// Signature shared by all benchmarked operations
+typedef int (*op_func_t)(const dataset_t *set, double scale, op_result_t *result);
+
+/*
+ * Simple xorshift generator so datasets are identical from run to run
+ */
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static unsigned long long next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void member_name(char *buf, int index) {
+    snprintf(buf, MAX_NAME_LEN, "m%06d.dat", index);
+}
+
+static long member_size(const dataset_t *set, double scale, int index) {
+    long lo = set->min_size * scale;
+    long hi = set->max_size * scale;
+    if (hi <= lo || set->num_files == 1) {
+        return lo;
+    }
+    double frac = (double) index / (set->num_files - 1);
+    if (set->log_sizes) {
+        // Most members small, a few large, like a typical source tree
+        frac = frac * frac * frac;
+    }
+    return lo + (long) ((hi - lo) * frac);
+}
+
+static int num_members(const dataset_t *set, double scale) {
+    int n = set->num_files * scale;
+    return n < 1 ? 1 : n;
+}
+
+/*
+ * Writes 'size' bytes of pseudo-random data to the file 'file_name'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_member(const char *file_name, long size) {
+    FILE *fp = fopen(file_name, "w");
+    if (!fp) {
+        perror("Failed to create dataset file");
+        return -1;
+    }
+    unsigned long long chunk[512];
+    while (size > 0) {
+        for (int i = 0; i < 512; i++) {
+            chunk[i] = next_random();
+        }
+        long n = size < sizeof(chunk) ? size : sizeof(chunk);
+        if (fwrite(chunk, 1, n, fp) != n) {
+            perror("Failed to write dataset file");
+            fclose(fp);
+            return -1;
+        }
+        size -= n;
+    }
+    if (fclose(fp)) {
+        perror("Failed to close dataset file");
+        return -1;
+    }
+    return 0;
+}
+
+static int generate_dataset(const dataset_t *set, double scale) {
+    char name[MAX_NAME_LEN];
+    for (int i = 0; i < num_members(set, scale); i++) {
+        member_name(name, i);
+        if (write_member(name, member_size(set, scale, i)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int build_file_list(const dataset_t *set, double scale, int count, file_list_t *files,
+                           long long *bytes) {
+    char name[MAX_NAME_LEN];
+    *bytes = 0;
+    for (int i = 0; i < count; i++) {
+        member_name(name, i);
+        if (file_list_add(files, name) == 1) {
+            return -1;
+        }
+        *bytes += member_size(set, scale, i);
+    }
+    return 0;
+}
+
+static long long archive_size(void) {
+    struct stat stat_buf;
+    if (stat(ARCHIVE_NAME, &stat_buf) != 0) {
+        return -1;
+    }
+    return stat_buf.st_size;
+}
+
+static int op_create(const dataset_t *set, double scale, op_result_t *result) {
+    file_list_t files;
+    file_list_init(&files);
+    int ret = build_file_list(set, scale, num_members(set, scale), &files, &result->bytes);
+    if (ret == 0) {
+        result->members = files.size;
+        ret = create_archive(ARCHIVE_NAME, &files);
+    }
+    file_list_clear(&files);
+    return ret;
+}
+
+static int op_append(const dataset_t *set, double scale, op_result_t *result) {
+    file_list_t files;
+    file_list_init(&files);
+    int ret = build_file_list(set, scale, num_members(set, scale), &files, &result->bytes);
+    if (ret == 0) {
+        result->members = files.size;
+        ret = append_files_to_archive(ARCHIVE_NAME, &files);
+    }
+    file_list_clear(&files);
+    return ret;
+}
+
+/*
+ * Mirrors what the -u command does: check membership, then append
+ */
+static int op_update(const dataset_t *set, double scale, op_result_t *result) {
+    int count = set->update_files;
+    if (count > num_members(set, scale)) {
+        count = num_members(set, scale);
+    }
+    for (int round = 0; round < set->update_rounds; round++) {
+        file_list_t files;
+        file_list_t in_archive;
+        file_list_init(&files);
+        file_list_init(&in_archive);
+        long long bytes;
+        int ret = build_file_list(set, scale, count, &files, &bytes);
+        if (ret == 0) {
+            ret = get_archive_file_list(ARCHIVE_NAME, &in_archive);
+        }
+        if (ret == 0 && !file_list_is_subset(&files, &in_archive)) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            ret = append_files_to_archive(ARCHIVE_NAME, &files);
+        }
+        file_list_clear(&files);
+        file_list_clear(&in_archive);
+        if (ret != 0) {
+            return -1;
+        }
+        result->members += count;
+        result->bytes += bytes;
+    }
+    return 0;
+}
+
+static int count_member(const minitar_member_t *member, void *arg) {
+    (*(long *) arg)++;
+    return 0;
+}
+
+// Streams the headers like "minitar -t" does, without printing them
+static int op_list(const dataset_t *set, double scale, op_result_t *result) {
+    long members = 0;
+    int ret = iterate_archive(ARCHIVE_NAME, count_member, &members);
+    result->members = members;
+    result->bytes = (long long) members * HEADER_SIZE;
+    return ret;
+}
+
+// Counts the members extract will write, outside of its timed run
+static int prepare_extract(const dataset_t *set, double scale, op_result_t *result) {
+    long members = 0;
+    int ret = iterate_archive(ARCHIVE_NAME, count_member, &members);
+    result->members = members;
+    return ret;
+}
+
+static int op_extract(const dataset_t *set, double scale, op_result_t *result) {
+    result->bytes = archive_size();
+    if (mkdir(EXTRACT_DIR, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create extraction directory");
+        return -1;
+    }
+    if (chdir(EXTRACT_DIR) != 0) {
+        perror("Failed to enter extraction directory");
+        return -1;
+    }
+    int ret = extract_files_from_archive("../" ARCHIVE_NAME);
+    if (chdir("..") != 0) {
+        perror("Failed to leave extraction directory");
+        return -1;
+    }
+    return ret;
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Runs 'op' in a child process and prints one JSON result line for it. If not
+ * NULL, 'prepare' runs first in the same child, outside the measurements.
+ * Returns 0 on success or -1 if the operation failed
+ */
+static int run_op(const dataset_t *set, double scale, const char *op_name, op_func_t prepare,
+                  op_func_t op) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("Failed to create pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        op_result_t result;
+        memset(&result, 0, sizeof(op_result_t));
+        if (prepare && prepare(set, scale, &result) != 0) {
+            _exit(1);
+        }
+        long long syscr0 = 0, syscw0 = 0, syscr1 = 0, syscw1 = 0;
+        int have_io = minitar_read_syscall_counts(&syscr0, &syscw0) == 0;
+        struct rusage usage0, usage1;
+        getrusage(RUSAGE_SELF, &usage0);
+        double start = now_seconds();
+        result.status = op(set, scale, &result);
+        result.seconds = now_seconds() - start;
+        getrusage(RUSAGE_SELF, &usage1);
+        result.user_seconds =
+            timeval_seconds(&usage1.ru_utime) - timeval_seconds(&usage0.ru_utime);
+        result.sys_seconds =
+            timeval_seconds(&usage1.ru_stime) - timeval_seconds(&usage0.ru_stime);
+        have_io = have_io && minitar_read_syscall_counts(&syscr1, &syscw1) == 0;
+        result.read_syscalls = have_io ? syscr1 - syscr0 : -1;
+        result.write_syscalls = have_io ? syscw1 - syscw0 : -1;
+        if (write(pipe_fds[1], &result, sizeof(op_result_t)) != sizeof(op_result_t)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    close(pipe_fds[1]);
+    op_result_t result;
+    ssize_t n = read(pipe_fds[0], &result, sizeof(op_result_t));
+    close(pipe_fds[0]);
+    int wstatus;
+    struct rusage usage;
+    if (wait4(pid, &wstatus, 0, &usage) < 0) {
+        perror("Failed to wait for benchmark child");
+        return -1;
+    }
+    if (n != sizeof(op_result_t) || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0 ||
+        result.status != 0) {
+        printf("{\"dataset\":\"%s\",\"op\":\"%s\",\"error\":true}\n", set->name, op_name);
+        return -1;
+    }
+
+    double secs = result.seconds > 0 ? result.seconds : 1e-9;
+    printf("{\"dataset\":\"%s\",\"op\":\"%s\",\"members\":%ld,\"bytes\":%lld,"
+           "\"seconds\":%.6f,\"mb_per_s\":%.2f,\"files_per_s\":%.1f,"
+           "\"user_seconds\":%.6f,\"sys_seconds\":%.6f,\"max_rss_kb\":%ld,"
+           "\"read_syscalls\":%lld,\"write_syscalls\":%lld}\n",
+           set->name, op_name, result.members, result.bytes, result.seconds,
+           result.bytes / secs / (1 << 20), result.members / secs,
+           result.user_seconds, result.sys_seconds, usage.ru_maxrss,
+           result.read_syscalls, result.write_syscalls);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftwbuf) {
+    return remove(path);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [-s SCALE] [-d DIR] [-i] [-n] [DATASET...]\n", prog);
+    printf("  -s SCALE  multiply file counts and sizes by SCALE (default 1.0)\n");
+    printf("  -d DIR    create scratch files under DIR (default /tmp)\n");
+    printf("  -i        copy member data with io_uring\n");
+    printf("  -n        skip fdatasync of written archives, to see what durability costs\n");
+    printf("Datasets:");
+    for (int i = 0; i < sizeof(datasets) / sizeof(datasets[0]); i++) {
+        printf(" %s", datasets[i].name);
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    double scale = 1.0;
+    const char *base_dir = "/tmp";
+    minitar_options_t opts;
+    minitar_options_init(&opts);
+    int opt;
+    while ((opt = getopt(argc, argv, "s:d:inh")) != -1) {
+        if (opt == 's') {
+            scale = atof(optarg);
+        } else if (opt == 'd') {
+            base_dir = optarg;
+        } else if (opt == 'i') {
+            opts.use_io_uring = 1;
+        } else if (opt == 'n') {
+            opts.sync = 0;
+        } else {
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (scale <= 0) {
+        printf("Scale must be positive\n");
+        return 1;
+    }
+    minitar_set_options(&opts);
+
+    static const struct {
+        const char *name;
+        op_func_t prepare;
+        op_func_t func;
+    } ops[] = {
+        {"create", NULL, op_create}, {"append", NULL, op_append},
+        {"update", NULL, op_update}, {"list", NULL, op_list},
+        {"extract", prepare_extract, op_extract},
+    };
+
+    int failed = 0;
+    for (int i = 0; i < sizeof(datasets) / sizeof(datasets[0]); i++) {
+        const dataset_t *set = &datasets[i];
+        int selected = optind == argc;
+        for (int j = optind; j < argc; j++) {
+            selected = selected || strcmp(argv[j], set->name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        char work_dir[MAX_PATH_LEN];
+        snprintf(work_dir, MAX_PATH_LEN, "%s/minitar-bench.XXXXXX", base_dir);
+        if (mkdtemp(work_dir) == NULL) {
+            perror("Failed to create scratch directory");
+            return 1;
+        }
+        char orig_dir[MAX_PATH_LEN];
+        if (getcwd(orig_dir, MAX_PATH_LEN) == NULL || chdir(work_dir) != 0) {
+            perror("Failed to enter scratch directory");
+            return 1;
+        }
+
+        if (generate_dataset(set, scale) != 0) {
+            failed = 1;
+        } else {
+            for (int j = 0; j < sizeof(ops) / sizeof(ops[0]); j++) {
+                if (run_op(set, scale, ops[j].name, ops[j].prepare, ops[j].func) != 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+
+        if (chdir(orig_dir) != 0) {
+            perror("Failed to leave scratch directory");
+            return 1;
+        }
+        nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return failed;
+}
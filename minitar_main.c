@@ -1,12 +1,214 @@
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "file_list.h"
 #include "minitar.h"
 
+// Buffer for stdout while listing, so even huge listings need few write calls
+#define LIST_BUFFER_SIZE (256 * 1024)
+
+// Set by -v, lists members with their mode, owner, size and mtime
+static int verbose = 0;
+
+// Statistics collected for --stats, printed by print_stats() when minitar exits
+static minitar_stats_t stats;
+// Syscall counts when statistics collection started, or -1 if unavailable
+static long long start_read_syscalls = -1;
+static long long start_write_syscalls = -1;
+
+static void print_stats(void) {
+    // Output still buffered for stdout is part of the run
+    fflush(stdout);
+    long long reads, writes;
+    if (start_read_syscalls >= 0 && minitar_read_syscall_counts(&reads, &writes) == 0) {
+        stats.read_syscalls = reads - start_read_syscalls;
+        stats.write_syscalls = writes - start_write_syscalls;
+    } else {
+        stats.read_syscalls = -1;
+        stats.write_syscalls = -1;
+    }
+    minitar_stats_print_json(&stats, stderr);
+}
+
+/*
+ * Parses a size in bytes, optionally followed by K, M or G for binary multiples
+ * Returns the size, or -1 if 'str' is not a valid size
+ */
+static long long parse_size(const char *str) {
+    char *end;
+    long long size = strtoll(str, &end, 10);
+    if (end == str || size < 0) {
+        return -1;
+    }
+    const char *suffixes = "KMG";
+    const char *suffix = *end ? strchr(suffixes, *end) : NULL;
+    if (suffix) {
+        size <<= 10 * (suffix - suffixes + 1);
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+/*
+ * Removes every long "--option" argument from 'argv', applying it to 'opts',
+ * and the -v flag, which sets 'verbose'.
+ * The remaining arguments keep their relative order, so the positional parsing
+ * in main() works the same whether or not options were given.
+ * Returns the new argument count, or -1 if an unknown option is found.
+ */
+int parse_long_options(int argc, char **argv, minitar_options_t *opts) {
+    int new_argc = 0;
+    int mtime_given = 0;
+    for (int i = 0; i < argc; i++) {
+        if (i > 0 && strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (i == 0 || strncmp(argv[i], "--", 2) != 0) {
+            argv[new_argc++] = argv[i];
+        } else if (strcmp(argv[i], "--no-restore-metadata") == 0) {
+            opts->restore_metadata = 0;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            opts->stats = &stats;
+        } else if (strcmp(argv[i], "--no-sync") == 0) {
+            opts->sync = 0;
+        } else if (strncmp(argv[i], "--split-size=", 13) == 0) {
+            opts->split_size = parse_size(argv[i] + 13);
+            if (opts->split_size < 512) {
+                printf("Invalid split size %s\n", argv[i] + 13);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--split-at-members") == 0) {
+            opts->split_at_members = 1;
+        } else if (strcmp(argv[i], "--reproducible") == 0) {
+            opts->reproducible = 1;
+        } else if (strncmp(argv[i], "--mtime=", 8) == 0) {
+            char *end;
+            opts->mtime = strtoll(argv[i] + 8, &end, 10);
+            if (end == argv[i] + 8 || *end != '\0' || opts->mtime < 0) {
+                printf("Invalid mtime %s\n", argv[i] + 8);
+                return -1;
+            }
+            mtime_given = 1;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            opts->use_io_uring = 1;
+        } else if (strcmp(argv[i], "--progress") == 0) {
+            opts->progress_fd = STDERR_FILENO;
+            opts->progress_json = 0;
+        } else if (strncmp(argv[i], "--progress-fd=", 14) == 0) {
+            char *end;
+            long fd = strtol(argv[i] + 14, &end, 10);
+            if (end == argv[i] + 14 || *end != '\0' || fd < 0 || fcntl(fd, F_GETFD) == -1) {
+                printf("Invalid progress file descriptor %s\n", argv[i] + 14);
+                return -1;
+            }
+            opts->progress_fd = fd;
+            opts->progress_json = 1;
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    argv[new_argc] = NULL;
+
+    // Without an explicit --mtime, follow the SOURCE_DATE_EPOCH convention of
+    // reproducible builds: no member gets a later mtime than the given time
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    if (opts->reproducible && !mtime_given && epoch) {
+        char *end;
+        opts->mtime = strtoll(epoch, &end, 10);
+        if (end == epoch || *end != '\0' || opts->mtime < 0) {
+            printf("Invalid SOURCE_DATE_EPOCH %s\n", epoch);
+            return -1;
+        }
+        opts->clamp_mtime = 1;
+    }
+    return new_argc;
+}
+
+/*
+ * Counts a listed member in '*listed'. The first line is flushed at once so
+ * that output starts right away even when stdout is fully buffered.
+ */
+static void count_listed(long *listed) {
+    if ((*listed)++ == 0) {
+        fflush(stdout);
+    }
+}
+
+static int print_member_name(const minitar_member_t *member, void *arg) {
+    printf("%s\n", member->name);
+    count_listed(arg);
+    return 0;
+}
+
+/*
+ * Prints 'member' in the style of "tar -tv": type and permissions, owner and
+ * group, size, modification time and name
+ */
+static int print_member_long(const minitar_member_t *member, void *arg) {
+    static const char *rwx = "rwxrwxrwx";
+    char perms[11];
+    perms[0] = member->typeflag == '5' ? 'd' : '-';
+    for (int i = 0; i < 9; i++) {
+        perms[i + 1] = member->mode & (0400 >> i) ? rwx[i] : '-';
+    }
+    if (member->mode & 04000) {
+        perms[3] = perms[3] == 'x' ? 's' : 'S';
+    }
+    if (member->mode & 02000) {
+        perms[6] = perms[6] == 'x' ? 's' : 'S';
+    }
+    if (member->mode & 01000) {
+        perms[9] = perms[9] == 'x' ? 't' : 'T';
+    }
+    perms[10] = '\0';
+
+    // Fall back to the numeric ids when the archive has no names
+    char owner[80];
+    int len = member->uname[0] ? snprintf(owner, sizeof(owner), "%s/", member->uname)
+                               : snprintf(owner, sizeof(owner), "%d/", (int) member->uid);
+    if (member->gname[0]) {
+        snprintf(owner + len, sizeof(owner) - len, "%s", member->gname);
+    } else {
+        snprintf(owner + len, sizeof(owner) - len, "%d", (int) member->gid);
+    }
+
+    char date[32];
+    struct tm tm;
+    if (!localtime_r(&member->mtime, &tm) ||
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm) == 0) {
+        snprintf(date, sizeof(date), "%lld", (long long) member->mtime);
+    }
+    // Like tar, owner and size together fill a column of at least 19 characters
+    int size_width = 18 - (int) strlen(owner);
+    printf("%s %s %*lld %s %s\n", perms, owner, size_width > 0 ? size_width : 0, member->size, date,
+           member->name);
+    count_listed(arg);
+    return 0;
+}
+
 int main(int argc, char **argv) {
+    minitar_options_t opts;
+    minitar_options_init(&opts);
+    argc = parse_long_options(argc, argv, &opts);
+    if (argc < 0) {
+        return 1;
+    }
+    minitar_set_options(&opts);
+    if (opts.stats && atexit(print_stats) != 0) {
+        printf("Failed to register statistics output\n");
+        return 1;
+    }
+    if (opts.stats &&
+        minitar_read_syscall_counts(&start_read_syscalls, &start_write_syscalls) != 0) {
+        start_read_syscalls = -1;
+    }
+
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s [OPTION...] -c|a|t|u|x [-v] -f ARCHIVE [FILE...]\n", argv[0]);
         return 0;
     }
 
@@ -57,18 +259,19 @@ int main(int argc, char **argv) {
             return 1;
         }
     } else if (strcmp(argv[1], "-t") == 0) {
-        // Get the archive file list store into files
-        if (get_archive_file_list(archive_name, &files) == -1) {
-            printf("Fail in get_archive_file_list.\n");
+        // Print each member as its header is read rather than collecting them first.
+        // A terminal keeps its line buffering, anything else gets a large buffer.
+        static char list_buffer[LIST_BUFFER_SIZE];
+        if (!isatty(STDOUT_FILENO)) {
+            setvbuf(stdout, list_buffer, _IOFBF, sizeof(list_buffer));
+        }
+        long listed = 0;
+        if (iterate_archive(archive_name, verbose ? print_member_long : print_member_name,
+                            &listed) == -1) {
+            printf("Fail in iterate_archive.\n");
             file_list_clear(&files);
             return 1;
         }
-
-        node_t *current = files.head;
-        while (current) {
-            printf("%s\n", current->name);
-            current = current->next;
-        }
     } else if (strcmp(argv[1], "-u") == 0) {    // Archive Update
         if (argc < 5) {
             printf("Error, you should have at least one file to update.\n");
@@ -115,13 +318,29 @@ int main(int argc, char **argv) {
         }
         file_list_clear(&files);
     } else if (strcmp(argv[1], "-x") == 0) {    // Archive Extract
-        if (extract_files_from_archive(archive_name) == -1) {
-            printf("Fail in extract_files_from_archive.\n");
-            file_list_clear(&files);
-            return 1;
+        // Without file arguments, extract every member
+        if (argc < 5) {
+            if (extract_files_from_archive(archive_name) == -1) {
+                printf("Fail in extract_files_from_archive.\n");
+                file_list_clear(&files);
+                return 1;
+            }
+        } else {
+            for (int i = 4; i < argc; i++) {
+                if (file_list_add(&files, argv[i]) == 1) {
+                    printf("Fail in file_list_add.\n");
+                    file_list_clear(&files);
+                    return 1;
+                }
+            }
+            if (extract_selected_files_from_archive(archive_name, &files) == -1) {
+                printf("Fail in extract_selected_files_from_archive.\n");
+                file_list_clear(&files);
+                return 1;
+            }
         }
     } else {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf("Usage: %s [OPTION...] -c|a|t|u|x [-v] -f ARCHIVE [FILE...]\n", argv[0]);
         file_list_clear(&files);
         return 1;
     }
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+# Serves the current directory over HTTP/1.1 with Range and keep-alive support,
+# for testing minitar against remote archives.
+#
+# Usage: range_server.py LOG_FILE [no-length|bad-range]
+# Prints "PORT PID" once listening, then keeps serving in the background.
+# Each request appends the number of body bytes sent to LOG_FILE.
+# "no-length" leaves out Content-Length and closes the connection after each
+# response instead. "bad-range" answers every range request one byte late.
+import http.server
+import os
+import re
+import sys
+
+
+class RangeHandler(http.server.SimpleHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    # Headers and body go out in separate writes, which Nagle would delay
+    disable_nagle_algorithm = True
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_body(self, status, body, headers):
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        if self.server.mode == "no-length":
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        else:
+            self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+        with open(self.server.log_file, "a") as log:
+            log.write("%d\n" % len(body))
+
+    def do_GET(self):
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            self.send_body(404, b"", [])
+            return
+        with open(path, "rb") as f:
+            data = f.read()
+        match = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if not match:
+            self.send_body(200, data, [])
+            return
+        start = int(match.group(1)) + (1 if self.server.mode == "bad-range" else 0)
+        end = int(match.group(2)) if match.group(2) else len(data) - 1
+        if start >= len(data):
+            self.send_body(416, b"", [("Content-Range", "bytes */%d" % len(data))])
+            return
+        end = min(end, len(data) - 1)
+        self.send_body(206, data[start:end + 1],
+                       [("Content-Range", "bytes %d-%d/%d" % (start, end, len(data)))])
+
+
+def main():
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), RangeHandler)
+    server.log_file = os.path.abspath(sys.argv[1])
+    server.mode = sys.argv[2] if len(sys.argv) > 2 else None
+    open(server.log_file, "w").close()
+    pid = os.fork()
+    if pid > 0:
+        print(server.server_address[1], pid, flush=True)
+        return
+    # Detach so the caller's command substitution does not wait for us
+    os.setsid()
+    devnull = os.open(os.devnull, os.O_RDWR)
+    for fd in range(3):
+        os.dup2(devnull, fd)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
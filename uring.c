@@ -0,0 +1,427 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+// Minimal io_uring engine used by minitar's copy paths
+//
+// Talks to the kernel through the raw io_uring syscalls so no extra library
+// is needed. A fixed set of buffers is registered with the kernel once, then
+// each buffer cycles through read -> write -> free while other buffers are in
+// flight, so reading ahead and writing behind happen on a single thread.
+// Buffers are filled from a stream of segments (header, file data, padding),
+// so one buffer may hold the end of one member and the start of the next.
+#include "uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#define HAVE_IO_URING 1
+#endif
+
+// Number of buffers, and so the most buffers being filled or written at once
+#define URING_DEPTH 8
+#define URING_BUF_SIZE (256 * 1024)
+// Most separate reads filling one buffer. Small segments are packed into a
+// buffer until it is full or this many reads are needed.
+#define URING_MAX_READS 8
+// Submission queue size, enough for every read of every buffer at once
+#define URING_ENTRIES (URING_DEPTH * URING_MAX_READS)
+
+#ifdef HAVE_IO_URING
+
+// What a buffer is currently being used for
+typedef enum { BUF_FREE, BUF_READING, BUF_WRITING } buf_state_t;
+
+// One read filling part of a buffer
+typedef struct {
+    int fd;
+    // Offset in 'fd' of the part still to be read
+    off_t offset;
+    // Where that part starts in the buffer, and where the read ends
+    unsigned start;
+    unsigned end;
+} uring_read_t;
+
+typedef struct {
+    buf_state_t state;
+    // Offset of this buffer's data in the output, relative to the start of the write
+    long long offset;
+    // Bytes of output the buffer holds, and bytes of the current write done so far
+    unsigned len;
+    unsigned done;
+    // Reads filling the buffer, and how many of them have not completed yet
+    uring_read_t reads[URING_MAX_READS];
+    int num_reads;
+    int reads_left;
+    // Bytes that came from input files, and the last segment the buffer reached
+    long long data_bytes;
+    int last_segment;
+} uring_buf_t;
+
+// Where in the list of segments the next buffer starts filling from
+typedef struct {
+    int segment;
+    long long pos;
+} fill_cursor_t;
+
+// The ring shared with the kernel, mapped into our address space
+static struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *buffers;
+    // Number of SQEs filled in but not yet passed to io_uring_enter
+    unsigned to_submit;
+} ring = {.fd = -1};
+
+// 1 once set up, -1 if io_uring turned out to be unavailable, 0 before trying
+static int ring_status = 0;
+
+static double now_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Maps the submission and completion rings and the SQE array of 'ring.fd'
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int map_rings(const struct io_uring_params *params) {
+    size_t sq_len = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    size_t cq_len = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    int single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_len > sq_len) {
+        sq_len = cq_len;
+    }
+
+    char *sq_ptr = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                        IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    char *cq_ptr = sq_ptr;
+    if (!single_mmap) {
+        cq_ptr = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                      IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ring.sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    ring.sq_head = (unsigned *) (sq_ptr + params->sq_off.head);
+    ring.sq_tail = (unsigned *) (sq_ptr + params->sq_off.tail);
+    ring.sq_mask = (unsigned *) (sq_ptr + params->sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq_ptr + params->sq_off.array);
+    ring.cq_head = (unsigned *) (cq_ptr + params->cq_off.head);
+    ring.cq_tail = (unsigned *) (cq_ptr + params->cq_off.tail);
+    ring.cq_mask = (unsigned *) (cq_ptr + params->cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq_ptr + params->cq_off.cqes);
+    return 0;
+}
+
+int uring_init(void) {
+    if (ring_status != 0) {
+        return ring_status > 0 ? 0 : -1;
+    }
+    ring_status = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd < 0) {
+        return -1;
+    }
+    if (map_rings(&params) != 0) {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    // Buffers come from mmap so they are page aligned, which O_DIRECT files need too
+    ring.buffers = mmap(NULL, URING_DEPTH * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buffers == MAP_FAILED) {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+    struct iovec iovecs[URING_DEPTH];
+    for (int i = 0; i < URING_DEPTH; i++) {
+        iovecs[i].iov_base = ring.buffers + (size_t) i * URING_BUF_SIZE;
+        iovecs[i].iov_len = URING_BUF_SIZE;
+    }
+    // Registering pins the buffers once, instead of on every read and write
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_DEPTH) !=
+        0) {
+        munmap(ring.buffers, URING_DEPTH * URING_BUF_SIZE);
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    ring_status = 1;
+    return 0;
+}
+
+/*
+ * Queues a fixed-buffer read or write of 'len' bytes at 'buf_off' in buffer
+ * 'index', to or from offset 'offset' of 'fd'
+ */
+static void queue_io(int opcode, int fd, int index, unsigned buf_off, unsigned len, off_t offset,
+                     unsigned long long user_data) {
+    unsigned tail = *ring.sq_tail;
+    unsigned slot = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) (ring.buffers + (size_t) index * URING_BUF_SIZE + buf_off);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = index;
+    sqe->user_data = user_data;
+    ring.sq_array[slot] = slot;
+    // The kernel must see the SQE contents before the new tail
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+}
+
+// Completions carry the buffer index in the low byte, and one more than the
+// index of the read in the buffer above it, or 0 for the buffer's write
+static void queue_read(int index, uring_buf_t *buf, int read) {
+    uring_read_t *r = &buf->reads[read];
+    queue_io(IORING_OP_READ_FIXED, r->fd, index, r->start, r->end - r->start, r->offset,
+             index | (unsigned long long) (read + 1) << 8);
+}
+
+static void queue_write(int index, uring_buf_t *buf, int out_fd, off_t out_off) {
+    queue_io(IORING_OP_WRITE_FIXED, out_fd, index, buf->done, buf->len - buf->done,
+             out_off + buf->offset + buf->done, index);
+}
+
+/*
+ * Fills buffer 'index' with the output following 'cursor', copying headers
+ * and padding in directly and noting the reads needed for file data, then
+ * moves 'cursor' past it
+ */
+static void fill_buffer(int index, uring_buf_t *buf, const uring_segment_t *segments, int count,
+                        fill_cursor_t *cursor) {
+    char *data = ring.buffers + (size_t) index * URING_BUF_SIZE;
+    buf->len = 0;
+    buf->done = 0;
+    buf->num_reads = 0;
+    buf->data_bytes = 0;
+    while (cursor->segment < count && buf->len < URING_BUF_SIZE) {
+        const uring_segment_t *seg = &segments[cursor->segment];
+        long long data_end = seg->header_len + seg->size;
+        long long pos = cursor->pos;
+        long long room = URING_BUF_SIZE - buf->len;
+        long long n;
+        if (pos < seg->header_len) {
+            n = seg->header_len - pos < room ? seg->header_len - pos : room;
+            memcpy(data + buf->len, (const char *) seg->header + pos, n);
+        } else if (pos < data_end) {
+            if (buf->num_reads == URING_MAX_READS) {
+                break;
+            }
+            n = data_end - pos < room ? data_end - pos : room;
+            uring_read_t *r = &buf->reads[buf->num_reads++];
+            r->fd = seg->in_fd;
+            r->offset = seg->in_off + (pos - seg->header_len);
+            r->start = buf->len;
+            r->end = buf->len + n;
+            buf->data_bytes += n;
+        } else {
+            n = data_end + seg->pad - pos < room ? data_end + seg->pad - pos : room;
+            memset(data + buf->len, 0, n);
+        }
+        buf->last_segment = cursor->segment;
+        buf->len += n;
+        cursor->pos += n;
+        if (cursor->pos == data_end + seg->pad) {
+            cursor->segment++;
+            cursor->pos = 0;
+        }
+    }
+}
+
+/*
+ * Submits all queued SQEs and waits until at least one completion is ready
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int submit_and_wait(const uring_callbacks_t *callbacks) {
+    void (*on_wait)(void *, double, double) = callbacks->on_wait;
+    double wall = on_wait ? now_seconds(CLOCK_MONOTONIC) : 0;
+    double cpu = on_wait ? now_seconds(CLOCK_THREAD_CPUTIME_ID) : 0;
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS,
+                      NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        perror("io_uring_enter error");
+        return -1;
+    }
+    ring.to_submit -= ret;
+    if (on_wait) {
+        on_wait(callbacks->arg, now_seconds(CLOCK_MONOTONIC) - wall,
+                now_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu);
+    }
+    return 0;
+}
+
+int uring_write_segments(const uring_segment_t *segments, int count, int out_fd, off_t out_off,
+                         const uring_callbacks_t *callbacks) {
+    if (ring_status <= 0) {
+        return -1;
+    }
+    static const uring_callbacks_t no_callbacks;
+    if (!callbacks) {
+        callbacks = &no_callbacks;
+    }
+    long long total = 0;
+    for (int i = 0; i < count; i++) {
+        total += segments[i].header_len + segments[i].size + segments[i].pad;
+    }
+    uring_buf_t bufs[URING_DEPTH];
+    memset(bufs, 0, sizeof(bufs));
+    fill_cursor_t cursor = {0, 0};
+    long long next_fill = 0;
+    long long written = 0;
+    int in_flight = 0;
+    int failed = 0;
+
+    while (written < total) {
+        // Start filling every free buffer, writing right away what needs no reads
+        for (int i = 0; i < URING_DEPTH && next_fill < total && !failed; i++) {
+            uring_buf_t *buf = &bufs[i];
+            if (buf->state != BUF_FREE) {
+                continue;
+            }
+            buf->offset = next_fill;
+            fill_buffer(i, buf, segments, count, &cursor);
+            next_fill += buf->len;
+            if (buf->num_reads == 0) {
+                buf->state = BUF_WRITING;
+                queue_write(i, buf, out_fd, out_off);
+                in_flight++;
+                continue;
+            }
+            buf->state = BUF_READING;
+            buf->reads_left = buf->num_reads;
+            for (int r = 0; r < buf->num_reads; r++) {
+                queue_read(i, buf, r);
+                in_flight++;
+            }
+        }
+        if (in_flight == 0) {
+            break;
+        }
+        if (submit_and_wait(callbacks) != 0) {
+            // Nothing in flight can be waited for safely anymore, so give up on the ring
+            ring_status = -1;
+            return -1;
+        }
+
+        // Reap every completion that is ready
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int index = cqe->user_data & 0xff;
+            int read = (int) (cqe->user_data >> 8) - 1;
+            int res = cqe->res;
+            uring_buf_t *buf = &bufs[index];
+            int is_write = read < 0;
+            in_flight--;
+            if (res <= 0) {
+                // A read of 0 bytes means the file is shorter than expected
+                if (res < 0) {
+                    errno = -res;
+                    perror(is_write ? "io_uring write error" : "io_uring read error");
+                } else if (!is_write) {
+                    printf("Unexpected end of file while copying data\n");
+                }
+                failed = 1;
+            } else if (callbacks->on_io) {
+                callbacks->on_io(callbacks->arg, is_write, res);
+            }
+
+            if (!is_write) {
+                uring_read_t *r = &buf->reads[read];
+                if (res > 0) {
+                    r->start += res;
+                    r->offset += res;
+                }
+                if (res > 0 && !failed && r->start < r->end) {
+                    // Short read, queue the rest
+                    queue_read(index, buf, read);
+                    in_flight++;
+                } else if (--buf->reads_left == 0) {
+                    if (failed) {
+                        buf->state = BUF_FREE;
+                    } else {
+                        buf->state = BUF_WRITING;
+                        queue_write(index, buf, out_fd, out_off);
+                        in_flight++;
+                    }
+                }
+                continue;
+            }
+            if (res > 0) {
+                buf->done += res;
+            }
+            if (res > 0 && !failed && buf->done < buf->len) {
+                // Short write, queue the rest
+                queue_write(index, buf, out_fd, out_off);
+                in_flight++;
+            } else {
+                buf->state = BUF_FREE;
+                if (!failed) {
+                    written += buf->len;
+                    if (callbacks->on_written) {
+                        callbacks->on_written(callbacks->arg, buf->last_segment, buf->data_bytes);
+                    }
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // After a failure, drain what is still in flight before returning
+        if (failed && in_flight == 0) {
+            return -1;
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+#else
+
+int uring_init(void) {
+    return -1;
+}
+
+int uring_write_segments(const uring_segment_t *segments, int count, int out_fd, off_t out_off,
+                         const uring_callbacks_t *callbacks) {
+    return -1;
+}
+
+#endif    // HAVE_IO_URING
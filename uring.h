@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+
+// A run of output made of an optional header, then 'size' bytes read from
+// 'in_fd' starting at 'in_off', then 'pad' zero bytes. Used to describe one
+// archive member, so several members can go through the ring in one call.
+typedef struct {
+    const void *header;
+    unsigned header_len;
+    int in_fd;
+    off_t in_off;
+    long long size;
+    unsigned pad;
+} uring_segment_t;
+
+// Hooks for statistics and progress reports. Any of them may be NULL, and
+// each is passed 'arg'.
+typedef struct {
+    // Called once per completed read (is_write == 0) or write (is_write == 1)
+    // with the number of bytes it transferred
+    void (*on_io)(void *arg, int is_write, long long nbytes);
+    // Called once a buffer has been written out, with the number of bytes
+    // read from the input files it held and the index of the last segment
+    // it reached
+    void (*on_written)(void *arg, int segment, long long data_bytes);
+    // Called with the time spent in one io_uring_enter syscall
+    void (*on_wait)(void *arg, double wall_seconds, double cpu_seconds);
+    void *arg;
+} uring_callbacks_t;
+
+// Set up the io_uring instance and its registered buffers if not done yet.
+// Returns 0 if io_uring can be used, or -1 if it is unavailable (for example
+// on older kernels or when blocked by a seccomp filter), in which case callers
+// should fall back to synchronous I/O. Failure is remembered, so calling this
+// again is cheap.
+int uring_init(void);
+
+// Write the 'count' segments back to back to 'out_fd' starting at 'out_off',
+// keeping several reads and writes in flight at once. Output is packed into
+// the registered buffers regardless of segment boundaries, so the reads of
+// one segment overlap the writes of the ones before it, and small segments
+// share a single write. Neither descriptor's file offset is used or changed,
+// and 'out_fd' must not have been opened with O_APPEND. 'callbacks' may be NULL.
+// Requires a successful uring_init(). Returns 0 on success or -1 on error.
+int uring_write_segments(const uring_segment_t *segments, int count, int out_fd, off_t out_off,
+                         const uring_callbacks_t *callbacks);
+
+#endif    // _URING_H